@@ -0,0 +1,1269 @@
+#pragma once
+
+// Everything needed to find running instances and talk to them. Shared by keep-awake and its client library.
+
+#include "win32-utils.h"
+
+constexpr auto g_myGuid = L"BAF0674F-E091-468A-AAA9-234909F4CFFB";
+
+constexpr ULONGLONG g_infiniteTick = std::numeric_limits<ULONGLONG>::max();
+
+#pragma region Instance Pipes
+
+inline std::wstring makePipeName(DWORD procId) {
+    return std::format(L"\\\\.\\pipe\\{}-{}", g_myGuid, procId);
+}
+
+// Well-known pipe of the current user's broker
+inline std::wstring makeBrokerPipeName() {
+    std::vector<BYTE> buf;
+    getTokenInfo(GetCurrentProcessToken(), TokenUser, buf);
+    auto pusr = (TOKEN_USER *)buf.data();
+    unqiue_local_membuf<wchar_t> stringUserSid;
+    if (!ConvertSidToStringSidW(pusr->User.Sid, std::out_ptr(stringUserSid)))
+        throwLastError("ConvertSidToStringSid");
+    return std::format(L"\\\\.\\pipe\\{}-broker-{}", g_myGuid, stringUserSid.get());
+}
+
+#pragma endregion
+
+#pragma region Instance Registry
+
+// Running instances publish information about themselves in small memory-mapped files, one 
+// per user, that everybody can read but only their user can write. This allows list to find 
+// them without enumerating every process on the machine and querying each one over its pipe.
+// Records in a file are only trusted if they belong to the file's owner.
+//
+// Each slot is claimed by a process via CAS on its owner field and only the owner ever 
+// writes the record. Readers do not lock: the sequence field acts as a seqlock - it is odd 
+// while a write is in progress and changes on every write. Slots whose owners are gone
+// (e.g. crashed) are reclaimed by the next process of the same user that notices it.
+// An InstanceRegistry object must not be used by several threads at once.
+
+constexpr ULONGLONG g_registrySignature = 0x4B41'5752'0000'0001; //"KAWR", version 1
+constexpr size_t g_registrySlotCount = 2048;
+
+struct RegistryRecord {
+    DWORD pid;
+    DWORD sessionId;
+    ULONGLONG creationTime;     //process creation time, guards against pid reuse
+    ULONGLONG startTick;        //GetTickCount64() when the instance started
+    ULONGLONG deadlineTick;     //GetTickCount64() when the instance expires or g_infiniteTick
+    BYTE userSid[SECURITY_MAX_SID_SIZE];
+    DWORD flags;                //RegistryFlags, occupies what used to be padding
+    ULONGLONG bootTime;         //currentBootTime() when published, tells records of earlier boots apart
+};
+static_assert(sizeof(RegistryRecord) == 112);
+
+enum RegistryFlags : DWORD {
+    registryBroker = 0x0001     //instance is a broker holding leases
+};
+
+struct RegistrySlot {
+    DWORD owner;
+    DWORD sequence;
+    RegistryRecord record;
+    BYTE reserved[8];
+};
+static_assert(sizeof(RegistrySlot) == 128);
+
+struct RegistryHeader {
+    ULONGLONG signature;
+    ULONGLONG generation;       //incremented on every change
+    BYTE reserved[48];
+};
+static_assert(sizeof(RegistryHeader) == 64);
+
+constexpr size_t g_registrySize = sizeof(RegistryHeader) + g_registrySlotCount * sizeof(RegistrySlot);
+
+// UTC FILETIME of the last boot. It moves with adjustments of the system clock.
+inline ULONGLONG currentBootTime() noexcept {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return fileTimeToUInt64(now) - GetTickCount64() * 10'000;
+}
+
+// Consecutive boots are always further apart than this, clock adjustments
+// made while an instance is running hopefully are not.
+constexpr ULONGLONG g_bootTimeTolerance = 60ull * 10'000'000;
+
+// Whether a record was published since the last boot rather than left over from an earlier one.
+// Ticks in records from earlier boots are meaningless.
+inline bool isFromCurrentBoot(const RegistryRecord & record) noexcept {
+    auto boot = currentBootTime();
+    return (record.bootTime > boot ? record.bootTime - boot : boot - record.bootTime) <= g_bootTimeTolerance;
+}
+
+// Whether an instance is listening on its pipe. Does not connect to it.
+inline bool isInstanceListening(DWORD pid) noexcept {
+    wchar_t name[128];
+    *std::format_to_n(name, std::ssize(name) - 1, L"\\\\.\\pipe\\{}-{}", g_myGuid, pid).out = 0;
+    if (WaitNamedPipeW(name, 1))
+        return true;
+    //all pipe instances are busy
+    return GetLastError() == ERROR_SEM_TIMEOUT;
+}
+
+// Checks whether a process that published a record is still running. Processes we are not 
+// allowed to open (e.g. other users') are assumed to be if the record is from the current 
+// boot and the instance still listens on its pipe.
+inline bool isPublisherAlive(DWORD pid, const RegistryRecord * record) noexcept {
+    AutoHandle process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, false, pid);
+    if (!process) {
+        if (GetLastError() == ERROR_INVALID_PARAMETER)
+            return false;
+        return (!record || isFromCurrentBoot(*record)) && isInstanceListening(pid);
+    }
+    DWORD exitCode;
+    if (GetExitCodeProcess(process.get(), &exitCode) && exitCode != STILL_ACTIVE)
+        return false;
+    FILETIME creation, exitTime, kernelTime, userTime;
+    if (record && GetProcessTimes(process.get(), &creation, &exitTime, &kernelTime, &userTime))
+        return fileTimeToUInt64(creation) == record->creationTime;
+    return true;
+}
+
+class InstanceRegistry {
+public:
+    // Returns nullptr if the registry is not available. Callers are expected 
+    // to fall back on other means of discovery in this case.
+    static std::unique_ptr<InstanceRegistry> open() noexcept {
+        try {
+            std::unique_ptr<InstanceRegistry> ret(new InstanceRegistry);
+            if (ret->init())
+                return ret;
+        } catch (std::exception &) {
+        }
+        return nullptr;
+    }
+
+    ~InstanceRegistry() noexcept {
+        if (m_mySlot)
+            release(*m_own, *m_mySlot);
+    }
+    InstanceRegistry(const InstanceRegistry &) = delete;
+    InstanceRegistry & operator=(const InstanceRegistry &) = delete;
+
+    // Publishes or updates the record for this process
+    bool publish(const RegistryRecord & record) noexcept {
+        if (!m_mySlot) {
+            if (!m_own)
+                m_own = openOwnFile();
+            if (!m_own)
+                return false;
+            m_mySlot = claim(*m_own);
+            if (!m_mySlot)
+                return false;
+        }
+        auto published = record;
+        published.bootTime = currentBootTime();
+        write(*m_mySlot, published);
+        bumpGeneration(*m_own);
+        return true;
+    }
+
+    // Changes on every change to the registry
+    ULONGLONG generation() noexcept {
+        refresh();
+        ULONGLONG ret = 0;
+        for (auto & [name, file]: m_files)
+            ret += std::atomic_ref<ULONGLONG>(file.header().generation).load(std::memory_order_acquire);
+        return ret;
+    }
+
+    // Manual-reset event signaled on every change to the registry or nullptr if not available.
+    // Watchers reset it before reading generation() so any later change signals it again.
+    HANDLE changeEvent() const noexcept 
+        { return m_changed.get(); }
+    void resetChangeEvent() noexcept {
+        if (m_changed)
+            ResetEvent(m_changed.get());
+    }
+
+    // Calls proc(record) for every published record whose publisher is still running.
+    // Slots of our own processes that are gone are reclaimed along the way.
+    void forEachLive(std::invocable<const RegistryRecord &> auto && proc) {
+        refresh();
+        for (auto & [name, file]: m_files) {
+            for (auto & slot: file.slots()) {
+                auto pid = std::atomic_ref<DWORD>(slot.owner).load(std::memory_order_acquire);
+                if (pid == 0)
+                    continue;
+                RegistryRecord record{};
+                bool consistent = read(slot, record) && record.pid == pid;
+                if (!isPublisherAlive(pid, consistent ? &record : nullptr)) {
+                    if (file.writable)
+                        changeOwner(file, slot, pid, 0);
+                    continue;
+                }
+                if (consistent && file.trusts(PSID(record.userSid)))
+                    proc(record);
+            }
+        }
+    }
+
+private:
+    struct RegistryFile {
+        AutoFile handle;
+        AutoHandle mapping;
+        std::unique_ptr<BYTE, MappedViewDeleter> view;
+        std::vector<BYTE> owner;    //empty if owned by SYSTEM or administrators, who are trusted with any records
+        bool writable = false;
+
+        bool map(bool forWriting) {
+            writable = forWriting;
+            mapping = CreateFileMappingW(handle.get(), nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, DWORD(g_registrySize), nullptr);
+            if (!mapping)
+                return false;
+            view.reset((BYTE *)MapViewOfFile(mapping.get(), FILE_MAP_READ | (writable ? FILE_MAP_WRITE : 0), 0, 0, g_registrySize));
+            if (!view)
+                return false;
+
+            PSID ownerSid;
+            unqiue_local_membuf<SECURITY_DESCRIPTOR> desc;
+            if (GetSecurityInfo(handle.get(), SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION, &ownerSid, nullptr, nullptr, nullptr, 
+                                std::out_ptr(desc)) != ERROR_SUCCESS || !IsValidSid(ownerSid))
+                return false;
+            if (!IsWellKnownSid(ownerSid, WinLocalSystemSid) && !IsWellKnownSid(ownerSid, WinBuiltinAdministratorsSid)) {
+                owner.resize(GetLengthSid(ownerSid));
+                if (!CopySid(DWORD(owner.size()), owner.data(), ownerSid))
+                    return false;
+            }
+            return true;
+        }
+
+        bool trusts(PSID user) const noexcept {
+            return owner.empty() || (IsValidSid(user) && EqualSid(PSID(owner.data()), user));
+        }
+
+        RegistryHeader & header() const 
+            { return *reinterpret_cast<RegistryHeader *>(view.get()); }
+        std::span<RegistrySlot, g_registrySlotCount> slots() const 
+            { return std::span<RegistrySlot, g_registrySlotCount>(reinterpret_cast<RegistrySlot *>(view.get() + sizeof(RegistryHeader)), g_registrySlotCount); }
+    };
+
+    InstanceRegistry() noexcept = default;
+
+    bool init() {
+        std::wstring dir;
+        dir.resize(MAX_PATH);
+        auto size = GetEnvironmentVariableW(L"ProgramData", dir.data(), DWORD(dir.size()));
+        if (size == 0 || size >= dir.size())
+            return false;
+        dir.resize(size);
+        dir += L"\\keep-awake";
+
+        // Any user needs to be able to add their own file but not to delete or replace others'.
+        // Inheritance is blocked since the ACLs of the parent folder are not necessarily suitable.
+        auto dirDesc = makeSecurityDescriptor(L"D:P(A;OICI;FA;;;SY)(A;OICI;FA;;;BA)(A;;0x1200ab;;;AU)");
+        SECURITY_ATTRIBUTES sa;
+        sa.nLength = sizeof(sa);
+        sa.lpSecurityDescriptor = dirDesc.get();
+        sa.bInheritHandle = false;
+        if (!CreateDirectoryW(dir.c_str(), &sa) && GetLastError() != ERROR_ALREADY_EXISTS)
+            return false;
+        m_dir = std::move(dir);
+
+        // Change notifications are optional: without them watchers merely poll. Unlike sections, events in
+        // Global\ do not need SeCreateGlobalPrivilege so any user can create this one.
+        auto eventDesc = makeSecurityDescriptor(L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;0x00100002;;;AU)");
+        sa.lpSecurityDescriptor = eventDesc.get();
+        m_changed = CreateEventExW(&sa, std::format(L"Global\\keep-awake-registry-{}", g_myGuid).c_str(), 
+                                   CREATE_EVENT_MANUAL_RESET, EVENT_MODIFY_STATE | SYNCHRONIZE);
+        return true;
+    }
+
+    // Opens or creates the current user's file
+    RegistryFile * openOwnFile() noexcept {
+        try {
+            std::vector<BYTE> buf;
+            getTokenInfo(GetCurrentProcessToken(), TokenUser, buf);
+            auto user = ((TOKEN_USER *)buf.data())->User.Sid;
+            unqiue_local_membuf<wchar_t> userSid;
+            if (!ConvertSidToStringSidW(user, std::out_ptr(userSid)))
+                return nullptr;
+
+            // Anybody can create files here so one named after us is not necessarily ours (and readers would 
+            // ignore our records in it). Use the first one we actually own or create one under a name nobody 
+            // could have taken in advance.
+            auto prefix = std::format(L"instances-{}-", userSid.get());
+            for (auto & name: findFiles(prefix + L"*.dat")) {
+                RegistryFile file;
+                file.handle = CreateFileW(std::format(L"{}\\{}", m_dir, name).c_str(), GENERIC_READ | GENERIC_WRITE, 
+                                          FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 
+                                          FILE_ATTRIBUTE_NORMAL, nullptr);
+                if (file.handle && file.map(true) && file.trusts(user) && initSignature(file))
+                    return &(m_files[name] = std::move(file));
+            }
+
+            auto fileDesc = makeSecurityDescriptor(std::format(L"O:{0}D:P(A;;FA;;;SY)(A;;FA;;;BA)(A;;FA;;;{0})(A;;FR;;;AU)", 
+                                                               userSid.get()).c_str());
+            SECURITY_ATTRIBUTES sa;
+            sa.nLength = sizeof(sa);
+            sa.lpSecurityDescriptor = fileDesc.get();
+            sa.bInheritHandle = false;
+            std::random_device random;
+            for (int attempt = 0; attempt < 4; ++attempt) {
+                auto name = std::format(L"{}{:08x}{:08x}.dat", prefix, random(), random());
+                RegistryFile file;
+                file.handle = CreateFileW(std::format(L"{}\\{}", m_dir, name).c_str(), GENERIC_READ | GENERIC_WRITE, 
+                                          FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, &sa, CREATE_NEW, 
+                                          FILE_ATTRIBUTE_NORMAL | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED, nullptr);
+                if (!file.handle) {
+                    if (GetLastError() == ERROR_FILE_EXISTS)
+                        continue;
+                    return nullptr;
+                }
+                if (!file.map(true) || !file.trusts(user) || !initSignature(file))
+                    return nullptr;
+                return &(m_files[std::move(name)] = std::move(file));
+            }
+            return nullptr;
+        } catch (std::exception &) {
+            return nullptr;
+        }
+    }
+
+    // A freshly created (zero-filled) file is a valid empty registry
+    static bool initSignature(RegistryFile & file) noexcept {
+        ULONGLONG signature = 0;
+        return std::atomic_ref<ULONGLONG>(file.header().signature).compare_exchange_strong(signature, g_registrySignature) ||
+               signature == g_registrySignature;
+    }
+
+    // Names of the files in the registry directory matching a pattern
+    std::vector<std::wstring> findFiles(const std::wstring & pattern) const {
+        std::vector<std::wstring> names;
+        WIN32_FIND_DATAW data;
+        auto find = FindFirstFileExW(std::format(L"{}\\{}", m_dir, pattern).c_str(), FindExInfoBasic, &data, 
+                                     FindExSearchNameMatch, nullptr, 0);
+        if (find == INVALID_HANDLE_VALUE)
+            return names;
+        try {
+            do {
+                names.emplace_back(data.cFileName);
+            } while (FindNextFileW(find, &data));
+        } catch (...) {
+            FindClose(find);
+            throw;
+        }
+        FindClose(find);
+        return names;
+    }
+
+    // Maps files of users that published records since the last call
+    void refresh() noexcept {
+        try {
+            auto names = findFiles(L"instances-*.dat");
+            for (auto & name: names) {
+                if (m_files.contains(name))
+                    continue;
+                RegistryFile file;
+                file.handle = CreateFileW(std::format(L"{}\\{}", m_dir, name).c_str(), GENERIC_READ, 
+                                          FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 
+                                          FILE_ATTRIBUTE_NORMAL, nullptr);
+                //files still being initialized are picked up next time
+                if (!file.handle || !file.map(false) || 
+                    std::atomic_ref<ULONGLONG>(file.header().signature).load(std::memory_order_acquire) != g_registrySignature)
+                    continue;
+                m_files.emplace(std::move(name), std::move(file));
+            }
+        } catch (std::exception &) {
+        }
+    }
+
+    void bumpGeneration(RegistryFile & file) noexcept {
+        std::atomic_ref<ULONGLONG>(file.header().generation).fetch_add(1, std::memory_order_release);
+        if (m_changed)
+            SetEvent(m_changed.get());
+    }
+
+    RegistrySlot * claim(RegistryFile & file) noexcept {
+        auto mypid = GetCurrentProcessId();
+        for (auto & slot: file.slots()) {
+            if (changeOwner(file, slot, 0, mypid))
+                return &slot;
+        }
+        //No free slots: take over one left behind by a process that is gone
+        for (auto & slot: file.slots()) {
+            auto pid = std::atomic_ref<DWORD>(slot.owner).load(std::memory_order_acquire);
+            RegistryRecord record{};
+            bool consistent = read(slot, record) && record.pid == pid;
+            if (!isPublisherAlive(pid, consistent ? &record : nullptr) && changeOwner(file, slot, pid, mypid))
+                return &slot;
+        }
+        return nullptr;
+    }
+
+    void release(RegistryFile & file, RegistrySlot & slot) noexcept {
+        write(slot, RegistryRecord{});
+        std::atomic_ref<DWORD>(slot.owner).store(0, std::memory_order_release);
+        bumpGeneration(file);
+    }
+
+    bool changeOwner(RegistryFile & file, RegistrySlot & slot, DWORD from, DWORD to) noexcept {
+        std::atomic_ref<DWORD> owner(slot.owner);
+        if (owner.load(std::memory_order_relaxed) != from || !owner.compare_exchange_strong(from, to, std::memory_order_acq_rel))
+            return false;
+        if (from != 0)
+            bumpGeneration(file);
+        return true;
+    }
+
+    static void write(RegistrySlot & slot, const RegistryRecord & record) noexcept {
+        std::atomic_ref<DWORD> sequence(slot.sequence);
+        auto seq = sequence.load(std::memory_order_relaxed) | 1;
+        sequence.store(seq, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(&slot.record, &record, sizeof(record));
+        sequence.store(seq + 1, std::memory_order_release);
+    }
+
+    // Returns false if the slot is free or its record could not be read consistently.
+    // The retry count is bounded since a writer might have died in the middle of an update.
+    static bool read(RegistrySlot & slot, RegistryRecord & record) noexcept {
+        std::atomic_ref<DWORD> sequence(slot.sequence);
+        for (int attempt = 0; attempt < 64; ++attempt) {
+            if (std::atomic_ref<DWORD>(slot.owner).load(std::memory_order_acquire) == 0)
+                return false;
+            auto before = sequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                YieldProcessor();
+                continue;
+            }
+            memcpy(&record, &slot.record, sizeof(record));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == before)
+                return record.pid != 0;
+        }
+        return false;
+    }
+
+private:
+    std::wstring m_dir;
+    std::map<std::wstring, RegistryFile> m_files;   //by file name, std::map keeps slot pointers stable
+    RegistryFile * m_own = nullptr;
+    AutoHandle m_changed;
+    RegistrySlot * m_mySlot = nullptr;
+};
+
+#pragma endregion
+
+#pragma region Control Protocol
+
+// Binary control protocol.
+//
+// Every message starts with a fixed-layout MessageHeader followed by fixed-layout payload. 
+// Newer protocol versions may only append fields to existing messages so decoders accept 
+// messages that are longer than they expect and ignore the extra. 
+// Legacy 4-byte "info" and "stop" text commands are still understood by instances. Since 
+// every binary message is longer than that the two can never be confused.
+//
+// All fields are little-endian and naturally aligned so no packing is necessary.
+
+constexpr DWORD g_protocolMagic = 0x5057'414B;          //"KAWP"
+constexpr WORD g_protocolVersion = 1;
+constexpr ULONGLONG g_protocolInfinite = std::numeric_limits<ULONGLONG>::max();
+constexpr size_t g_maxMessageSize = 4096;
+
+enum class MessageType : WORD {
+    error       = 0,
+    infoRequest = 1,
+    infoReply   = 2,
+    stopRequest = 3,
+    acquireLeaseRequest = 4,
+    acquireLeaseReply   = 5,
+    listLeasesRequest   = 6,
+    listLeasesReply     = 7,
+    releaseLeaseRequest = 8,
+    statsRequest        = 9,
+    statsReply          = 10,
+    setDeadlineRequest  = 11
+};
+
+enum ProtocolCapabilities : DWORD {
+    capLegacyCommands   = 0x0001,
+    capInfo             = 0x0002,
+    capStop             = 0x0004,
+    capLeases           = 0x0008,   //instance is a broker
+    capStats            = 0x0010,
+    capSetDeadline      = 0x0020
+};
+
+struct MessageHeader {
+    DWORD magic;
+    WORD version;
+    MessageType type;
+    DWORD size;             //of the whole message, including the header
+    DWORD reserved;
+};
+static_assert(sizeof(MessageHeader) == 16);
+
+struct InfoRequest {
+    static constexpr auto messageType = MessageType::infoRequest;
+
+    MessageHeader header;
+};
+
+struct StopRequest {
+    static constexpr auto messageType = MessageType::stopRequest;
+
+    MessageHeader header;
+};
+
+struct InfoReply {
+    static constexpr auto messageType = MessageType::infoReply;
+
+    MessageHeader header;
+    ULONGLONG remainingMs;  //g_protocolInfinite if there is no deadline
+    ULONGLONG deadline;     //UTC FILETIME of expiration or g_protocolInfinite
+    ULONGLONG startTime;    //UTC FILETIME when the instance started
+    ULONGLONG durationMs;   //as originally requested or g_protocolInfinite
+    DWORD pid;
+    DWORD capabilities;     //ProtocolCapabilities
+};
+static_assert(sizeof(InfoReply) == 56);
+static_assert(offsetof(InfoReply, remainingMs) == 16);
+static_assert(offsetof(InfoReply, pid) == 48);
+
+struct ErrorReply {
+    static constexpr auto messageType = MessageType::error;
+
+    MessageHeader header;
+    DWORD code;             //Win32 error code
+    DWORD reserved;
+};
+static_assert(sizeof(ErrorReply) == 24);
+
+// Asks a broker for a new lease. Replied with AcquireLeaseReply.
+struct AcquireLeaseRequest {
+    static constexpr auto messageType = MessageType::acquireLeaseRequest;
+
+    MessageHeader header;
+    ULONGLONG durationMs;   //g_protocolInfinite for no deadline
+    ULONGLONG reserved;
+};
+static_assert(sizeof(AcquireLeaseRequest) == 32);
+
+struct AcquireLeaseReply {
+    static constexpr auto messageType = MessageType::acquireLeaseReply;
+
+    MessageHeader header;
+    DWORD leaseId;
+    DWORD pid;              //of the broker
+};
+static_assert(sizeof(AcquireLeaseReply) == 24);
+
+// Asks a broker for its leases with IDs starting from firstLease. Replied with ListLeasesReply.
+struct ListLeasesRequest {
+    static constexpr auto messageType = MessageType::listLeasesRequest;
+
+    MessageHeader header;
+    DWORD firstLease;
+    DWORD reserved;
+};
+static_assert(sizeof(ListLeasesRequest) == 24);
+
+struct LeaseInfo {
+    DWORD leaseId;
+    DWORD reserved;
+    ULONGLONG remainingMs;  //g_protocolInfinite if there is no deadline
+    ULONGLONG durationMs;   //g_protocolInfinite if there is no deadline
+    ULONGLONG ageMs;
+};
+static_assert(sizeof(LeaseInfo) == 32);
+
+constexpr size_t g_maxLeasesPerReply = 120;
+
+struct ListLeasesReply {
+    static constexpr auto messageType = MessageType::listLeasesReply;
+
+    MessageHeader header;
+    DWORD count;
+    DWORD more;             //non-zero if there are leases after the last one returned
+    LeaseInfo leases[g_maxLeasesPerReply];
+};
+static_assert(offsetof(ListLeasesReply, leases) == 24);
+
+// Releases a lease. Replied with ErrorReply whose code is ERROR_SUCCESS or ERROR_NOT_FOUND.
+struct ReleaseLeaseRequest {
+    static constexpr auto messageType = MessageType::releaseLeaseRequest;
+
+    MessageHeader header;
+    DWORD leaseId;
+    DWORD reserved;
+};
+static_assert(sizeof(ReleaseLeaseRequest) == 24);
+
+enum class DeadlineChange : DWORD {
+    extend          = 1,    //add to the time remaining, instances without a deadline stay so
+    setRemaining    = 2     //replace the time remaining
+};
+
+// Changes when an instance, or a lease of a broker, expires without restarting it. 
+// Replied with InfoReply describing the new state or ErrorReply on failure.
+struct SetDeadlineRequest {
+    static constexpr auto messageType = MessageType::setDeadlineRequest;
+
+    MessageHeader header;
+    ULONGLONG durationMs;
+    DeadlineChange change;
+    DWORD leaseId;          //0 for the instance itself
+};
+static_assert(sizeof(SetDeadlineRequest) == 32);
+
+inline bool isValidDeadlineChange(DeadlineChange change) noexcept {
+    return change == DeadlineChange::extend || change == DeadlineChange::setRemaining;
+}
+
+// Time remaining after applying a change to what is remaining now. Nothing means no deadline.
+inline std::optional<ULONGLONG> applyDeadlineChange(std::optional<ULONGLONG> remaining, DeadlineChange change, ULONGLONG durationMs) noexcept {
+    switch(change) {
+        case DeadlineChange::extend:
+            if (!remaining)
+                return std::nullopt;
+            return *remaining + std::min(durationMs, g_protocolInfinite - 1 - *remaining);
+        case DeadlineChange::setRemaining:
+            return durationMs;
+    }
+    return remaining;
+}
+
+struct StatsRequest {
+    static constexpr auto messageType = MessageType::statsRequest;
+
+    MessageHeader header;
+};
+
+// Number of request types counted separately in StatsReply, indexed by MessageType
+constexpr size_t g_statsRequestTypes = 16;
+
+// Upper bounds of request latency histogram buckets in microseconds. 
+// StatsReply has one more bucket for anything slower.
+constexpr ULONGLONG g_statsLatencyBoundsUs[] = { 10, 100, 1'000, 10'000, 100'000 };
+constexpr size_t g_statsLatencyBuckets = std::size(g_statsLatencyBoundsUs) + 1;
+
+struct StatsReply {
+    static constexpr auto messageType = MessageType::statsReply;
+
+    MessageHeader header;
+    ULONGLONG connections;                      //accepted since start
+    ULONGLONG requests[g_statsRequestTypes];    //served, by MessageType
+    ULONGLONG legacyRequests;                   //served legacy text commands
+    ULONGLONG malformed;                        //unrecognized, invalid or oversized requests
+    ULONGLONG latency[g_statsLatencyBuckets];   //request handling time histogram
+    ULONGLONG wakeups;                          //times the main loop woke up
+    ULONGLONG uptimeMs;
+    ULONGLONG powerRequestMs;                   //time the instance has been keeping the machine awake
+    ULONGLONG workingSet;                       //bytes
+    DWORD handles;
+    DWORD reserved;
+    ULONGLONG privateBytes;                     //committed memory that cannot be shared
+};
+static_assert(sizeof(StatsReply) == 264);
+static_assert(offsetof(StatsReply, privateBytes) == 256);
+
+template<class Message>
+concept ProtocolMessage = std::is_trivially_copyable_v<Message> && 
+                          std::is_same_v<decltype(Message::header), MessageHeader> &&
+                          sizeof(Message) <= g_maxMessageSize;
+
+template<ProtocolMessage Message>
+constexpr Message makeMessage() noexcept {
+    Message ret{};
+    ret.header.magic = g_protocolMagic;
+    ret.header.version = g_protocolVersion;
+    ret.header.type = Message::messageType;
+    ret.header.size = DWORD(sizeof(Message));
+    return ret;
+}
+
+template<ProtocolMessage Message>
+inline std::string_view messageBytes(const Message & msg) noexcept {
+    return std::string_view(reinterpret_cast<const char *>(&msg), sizeof(msg));
+}
+
+// Returns the type of a binary message or nothing if data is not one (e.g. a legacy command)
+inline std::optional<MessageType> peekMessageType(std::string_view data) noexcept {
+    MessageHeader header;
+    if (data.size() < sizeof(header))
+        return {};
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.magic != g_protocolMagic || header.version == 0 || header.size != data.size())
+        return {};
+    return header.type;
+}
+
+template<ProtocolMessage Message>
+inline bool decodeMessage(std::string_view data, Message & msg) noexcept {
+    if (peekMessageType(data) != Message::messageType || data.size() < sizeof(Message))
+        return false;
+    memcpy(&msg, data.data(), sizeof(Message));
+    return true;
+}
+
+#pragma endregion
+
+#pragma region Pipe Client
+
+// Client side of an instance control pipe connection.
+// Every operation fails with ERROR_TIMEOUT once the deadline expires. Instances keep a connection
+// open for a while after replying so it can be given a new deadline and reused for another request.
+class PipeConnection {
+public:
+    PipeConnection(const Deadline & deadline) noexcept:
+        m_deadline(deadline)
+    {}
+
+    void setDeadline(const Deadline & deadline) noexcept
+        { m_deadline = deadline; }
+
+    DWORD open(DWORD procId) 
+        { return open(makePipeName(procId)); }
+
+    DWORD open(const std::wstring & pipeName) {
+        if (m_deadline.expired())
+            return ERROR_TIMEOUT;
+        m_event = CreateEvent(nullptr, true, false, nullptr);
+        if (!m_event)
+            return GetLastError();
+        while(true) {
+            m_pipe = CreateFile(pipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+            if (m_pipe)
+                break;
+            DWORD err = GetLastError();
+            if (err != ERROR_PIPE_BUSY)
+                return err;
+            auto remaining = m_deadline.remaining();
+            if (remaining == 0)
+                return ERROR_TIMEOUT;
+            if (!WaitNamedPipe(pipeName.c_str(), remaining)) {
+                err = GetLastError();
+                return err == ERROR_SEM_TIMEOUT ? ERROR_TIMEOUT : err;
+            }
+        }
+        DWORD mode = PIPE_READMODE_MESSAGE;
+        if (!SetNamedPipeHandleState(m_pipe.get(), &mode, nullptr, nullptr))
+            return GetLastError();
+        return ERROR_SUCCESS;
+    }
+
+    DWORD write(std::string_view data) {
+        OVERLAPPED ovl{};
+        ovl.hEvent = m_event.get();
+        DWORD written = 0;
+        auto res = WriteFile(m_pipe.get(), data.data(), DWORD(data.size()), nullptr, &ovl);
+        return complete(ovl, res, written);
+    }
+
+    DWORD read(std::string & msg, size_t expectedSize) {
+        msg.resize(expectedSize);
+        size_t consumed = 0;
+        while(true) {
+            OVERLAPPED ovl{};
+            ovl.hEvent = m_event.get();
+            DWORD chunk = 0;
+            auto res = ReadFile(m_pipe.get(), msg.data() + consumed, DWORD(msg.size() - consumed), nullptr, &ovl);
+            auto err = complete(ovl, res, chunk);
+            consumed += chunk;
+            if (err == ERROR_SUCCESS) {
+                msg.resize(consumed);
+                return ERROR_SUCCESS;
+            }
+            if (err != ERROR_MORE_DATA)
+                return err;
+            DWORD left = 0;
+            if (!PeekNamedPipe(m_pipe.get(), nullptr, 0, nullptr, nullptr, &left))
+                return GetLastError();
+            msg.resize(consumed + std::max(DWORD(16), left));
+        }
+    }
+
+    // Reads a message that is expected to fit in buf. Larger messages fail with ERROR_MORE_DATA.
+    DWORD read(std::span<char> buf, size_t & size) {
+        OVERLAPPED ovl{};
+        ovl.hEvent = m_event.get();
+        DWORD chunk = 0;
+        auto res = ReadFile(m_pipe.get(), buf.data(), DWORD(buf.size()), nullptr, &ovl);
+        auto err = complete(ovl, res, chunk);
+        size = chunk;
+        return err;
+    }
+
+private:
+    DWORD complete(OVERLAPPED & ovl, BOOL started, DWORD & transferred) {
+        if (!started) {
+            auto err = GetLastError();
+            if (err != ERROR_IO_PENDING && err != ERROR_MORE_DATA)
+                return err;
+        }
+        if (WaitForSingleObject(ovl.hEvent, m_deadline.remaining()) != WAIT_OBJECT_0) {
+            CancelIoEx(m_pipe.get(), &ovl);
+            GetOverlappedResult(m_pipe.get(), &ovl, &transferred, true);
+            return ERROR_TIMEOUT;
+        }
+        if (!GetOverlappedResult(m_pipe.get(), &ovl, &transferred, false))
+            return GetLastError();
+        return ERROR_SUCCESS;
+    }
+private:
+    Deadline m_deadline;
+    AutoFile m_pipe;
+    AutoHandle m_event;
+};
+
+inline DWORD execOnPipe(DWORD procId, std::string_view cmd, const Deadline & deadline, std::invocable<PipeConnection &> auto && proc) 
+    requires(std::is_same_v<decltype(std::forward<decltype(proc)>(proc)(std::declval<PipeConnection &>())), DWORD> ||
+             std::is_same_v<decltype(std::forward<decltype(proc)>(proc)(std::declval<PipeConnection &>())), void>)
+{
+    PipeConnection conn(deadline);
+    if (auto err = conn.open(procId); err != ERROR_SUCCESS)
+        return err;
+    if (auto err = conn.write(cmd); err != ERROR_SUCCESS)
+        return err;
+    if constexpr (std::is_same_v<decltype(std::forward<decltype(proc)>(proc)(conn)), DWORD>)
+        return std::forward<decltype(proc)>(proc)(conn);
+    else {
+        std::forward<decltype(proc)>(proc)(conn);
+        return ERROR_SUCCESS;
+    }
+}
+
+#pragma endregion
+
+#pragma region Instance Queries
+
+// Requests, their replies and discovery of instances, shared by the command line and the client library 
+// so that both see the same instances and handle older versions the same way.
+
+constexpr auto g_maxDuration = std::numeric_limits<ULONGLONG>::max() / 1000;
+
+// Parses "[<num>w] [<num>d] [<num>h] [<num>m] [<num>[s]] [<num>ms]" into milliseconds.
+// Units are case insensitive, must appear in this order and whitespace is allowed anywhere.
+// Returns nullopt if the string is malformed and ULONGLONG max if the value is too large.
+constexpr std::optional<ULONGLONG> parseDuration(std::wstring_view str) {
+
+    constexpr ULONGLONG overflow = std::numeric_limits<ULONGLONG>::max();
+    constexpr ULONGLONG limit = g_maxDuration * 1000;
+
+    //Units in the order they must appear
+    enum Unit { weeks, days, hours, minutes, seconds, millis, unitCount };
+    constexpr ULONGLONG multiples[unitCount] = { 604'800'000, 86'400'000, 3'600'000, 60'000, 1'000, 1 };
+
+    constexpr auto isSpace = [](wchar_t c) {
+        return c == L' ' || c == L'\t' || c == L'\n' || c == L'\v' || c == L'\f' || c == L'\r';
+    };
+    constexpr auto isDigit = [](wchar_t c) {
+        return c >= L'0' && c <= L'9';
+    };
+    constexpr auto lower = [](wchar_t c) {
+        return c >= L'A' && c <= L'Z' ? wchar_t(c - L'A' + L'a') : c;
+    };
+
+    auto cur = str.begin();
+    const auto end = str.end();
+    auto skipSpace = [&]() {
+        while (cur != end && isSpace(*cur))
+            ++cur;
+    };
+
+    ULONGLONG acc = 0;
+    bool overflowed = false;
+    int nextUnit = weeks;
+    skipSpace();
+    if (cur == end)
+        return {};
+    while (cur != end) {
+        if (!isDigit(*cur))
+            return {};
+        ULONGLONG val = 0;
+        for ( ; cur != end && isDigit(*cur); ++cur) {
+            unsigned digit = unsigned(*cur - L'0');
+            if (val > (overflow - digit) / 10)
+                overflowed = true;
+            else
+                val = val * 10 + digit;
+        }
+        skipSpace();
+
+        Unit unit;
+        if (cur == end) {
+            unit = seconds;
+        } else {
+            switch(lower(*cur++)) {
+                case L'w': unit = weeks; break;
+                case L'd': unit = days; break;
+                case L'h': unit = hours; break;
+                case L'm': 
+                    if (cur != end && lower(*cur) == L's') {
+                        ++cur;
+                        unit = millis;
+                    } else {
+                        unit = minutes;
+                    }
+                    break;
+                case L's': unit = seconds; break;
+                default: return {};
+            }
+        }
+        if (unit < nextUnit)
+            return {};
+        nextUnit = unit + 1;
+
+        //Keep validating the rest of the string after an overflow: malformed input is reported as such
+        if (!overflowed && (limit - acc) / multiples[unit] < val)
+            overflowed = true;
+        if (!overflowed)
+            acc += val * multiples[unit];
+        skipSpace();
+    }
+    if (overflowed)
+        return overflow;
+    return acc;
+}
+
+static_assert(parseDuration(L"") == std::nullopt);
+static_assert(parseDuration(L"  ") == std::nullopt);
+static_assert(parseDuration(L"15") == 15'000);
+static_assert(parseDuration(L" 1d2h 3M 4 ") == 93'784'000);
+static_assert(parseDuration(L"1d 5") == 86'405'000);
+static_assert(parseDuration(L"2w 1ms") == 1'209'600'001);
+static_assert(parseDuration(L"1m 1ms") == 60'001);
+static_assert(parseDuration(L"1h 1d") == std::nullopt);
+static_assert(parseDuration(L"1 2") == std::nullopt);
+static_assert(parseDuration(L"1m s") == std::nullopt);
+static_assert(parseDuration(L"d") == std::nullopt);
+static_assert(parseDuration(L"99999999999999999999999") == std::numeric_limits<ULONGLONG>::max());
+static_assert(parseDuration(L"18446744073709551d") == std::numeric_limits<ULONGLONG>::max());
+
+// Instances close the connection on requests they do not understand
+inline bool isDisconnect(DWORD err) noexcept {
+    return err == ERROR_NO_DATA || err == ERROR_BROKEN_PIPE || err == ERROR_PIPE_NOT_CONNECTED;
+}
+
+// Sends a request to an instance and reads its reply into buf. Transports may reuse connections and 
+// must be safe to use from several threads at once.
+template<class T>
+concept InstanceTransport = requires(T & transport, DWORD pid, std::string_view request, const Deadline & deadline, 
+                                     std::span<char> buf, std::string_view & reply) {
+    { transport.exchange(pid, request, deadline, buf, reply) } -> std::same_as<DWORD>;
+};
+
+// Opens a new connection for every request
+struct PipeTransport {
+    DWORD exchange(DWORD pid, std::string_view request, const Deadline & deadline, std::span<char> buf, std::string_view & reply) {
+        return execOnPipe(pid, request, deadline, [&](PipeConnection & conn) -> DWORD {
+            size_t size;
+            if (auto err = conn.read(buf, size); err != ERROR_SUCCESS)
+                return err;
+            reply = std::string_view(buf.data(), size);
+            return ERROR_SUCCESS;
+        });
+    }
+};
+
+// Decodes the expected reply or the error an instance replied with instead
+template<ProtocolMessage Message>
+inline DWORD decodeReply(std::string_view data, Message & msg) noexcept {
+    if (decodeMessage(data, msg))
+        return ERROR_SUCCESS;
+    ErrorReply error;
+    if (decodeMessage(data, error) && error.code != ERROR_SUCCESS)
+        return error.code;
+    return ERROR_INVALID_DATA;
+}
+
+// Sends a binary request and decodes its reply. Instances from older versions disconnect on binary 
+// requests, which is reported as ERROR_NOT_SUPPORTED.
+template<ProtocolMessage Reply>
+inline DWORD callInstance(InstanceTransport auto & transport, DWORD pid, std::string_view request, 
+                          const Deadline & deadline, Reply & reply) {
+    char buf[g_maxMessageSize];
+    std::string_view data;
+    auto err = transport.exchange(pid, request, deadline, buf, data);
+    if (isDisconnect(err))
+        return ERROR_NOT_SUPPORTED;
+    if (err != ERROR_SUCCESS)
+        return err;
+    return decodeReply(data, reply);
+}
+
+enum class QueryStatus {
+    success,
+    inaccessible,
+    timedOut,
+    unavailable
+};
+
+inline QueryStatus queryStatusFromError(DWORD err) noexcept {
+    switch(err) {
+        case ERROR_SUCCESS:         return QueryStatus::success;
+        case ERROR_ACCESS_DENIED:   return QueryStatus::inaccessible;
+        case ERROR_TIMEOUT:         return QueryStatus::timedOut;
+        default:                    return QueryStatus::unavailable;
+    }
+}
+
+template<class T>
+struct QueryResult {
+    QueryStatus status = QueryStatus::unavailable;
+    T value{};
+};
+
+struct QueryLimits {
+    ULONGLONG perInstance = 2'000;
+    ULONGLONG total = 10'000;
+
+    Deadline deadlineFor(const Deadline & overall) const 
+        { return std::min(Deadline::after(perInstance), overall); }
+};
+
+// Calls proc(i) for every i in [0, count) concurrently on a bounded number of threads,
+// including the calling one. The first exception thrown by proc is rethrown once all
+// the calls complete.
+inline void forEachParallel(size_t count, std::invocable<size_t> auto && proc) {
+    constexpr size_t maxWorkers = 32;
+
+    std::atomic<size_t> next = 0;
+    std::exception_ptr failure;
+    std::mutex failureMutex;
+    auto work = [&]() noexcept {
+        try {
+            while(true) {
+                auto idx = next.fetch_add(1, std::memory_order_relaxed);
+                if (idx >= count)
+                    break;
+                proc(idx);
+            }
+        } catch(...) {
+            std::lock_guard lock(failureMutex);
+            if (!failure)
+                failure = std::current_exception();
+        }
+    };
+    {
+        std::vector<std::jthread> workers;
+        auto workerCount = std::min(count, maxWorkers);
+        for (size_t i = 1; i < workerCount; ++i)
+            workers.emplace_back(work);
+        work();
+    }
+    if (failure)
+        std::rethrow_exception(failure);
+}
+
+inline ULONGLONG wallClockNow() noexcept {
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return fileTimeToUInt64(ft);
+}
+
+// UTC FILETIME when something with remainingMs left expires
+inline std::optional<ULONGLONG> wallDeadline(ULONGLONG remainingMs) noexcept {
+    if (remainingMs == g_protocolInfinite)
+        return std::nullopt;
+    return wallClockNow() + remainingMs * 10'000;
+}
+
+struct InstanceInfo {
+    ULONGLONG remainingMs = g_protocolInfinite;
+    std::optional<ULONGLONG> deadline;  //UTC FILETIME of expiration, none if there is no deadline
+    std::optional<ULONGLONG> ageMs;     //not known for legacy instances
+    bool broker = false;
+};
+
+inline InstanceInfo infoFromReply(const InfoReply & reply) noexcept {
+    InstanceInfo ret;
+    ret.remainingMs = reply.remainingMs;
+    if (reply.deadline != g_protocolInfinite)
+        ret.deadline = reply.deadline;
+    auto now = wallClockNow();
+    ret.ageMs = now > reply.startTime ? (now - reply.startTime) / 10'000 : 0;
+    ret.broker = (reply.capabilities & capLeases) != 0;
+    return ret;
+}
+
+inline InstanceInfo infoFromLease(const LeaseInfo & lease) noexcept {
+    InstanceInfo ret;
+    ret.remainingMs = lease.remainingMs;
+    ret.deadline = wallDeadline(lease.remainingMs);
+    ret.ageMs = lease.ageMs;
+    ret.broker = true;
+    return ret;
+}
+
+// Instances from older versions only understand the legacy text command and are asked with it
+inline DWORD getInfo(InstanceTransport auto & transport, DWORD procId, const Deadline & deadline, InstanceInfo & info) {
+    auto request = makeMessage<InfoRequest>();
+    InfoReply reply;
+    auto err = callInstance(transport, procId, messageBytes(request), deadline, reply);
+    if (err == ERROR_SUCCESS)
+        info = infoFromReply(reply);
+    if (err != ERROR_NOT_SUPPORTED && err != ERROR_INVALID_DATA)
+        return err;
+
+    std::string text;
+    err = execOnPipe(procId, "info", deadline, [&text](PipeConnection & conn) -> DWORD {
+        return conn.read(text, 256);
+    }); 
+    if (err != ERROR_SUCCESS)
+        return err;
+    //legacy replies are durations formatted the way parseDuration() accepts
+    info = InstanceInfo{};
+    if (text == "Infinite")
+        return ERROR_SUCCESS;
+    auto remaining = parseDuration(widen(text));
+    if (!remaining)
+        return ERROR_INVALID_DATA;
+    info.remainingMs = *remaining;
+    info.deadline = wallDeadline(*remaining);
+    return ERROR_SUCCESS;
+}
+
+// The legacy command is understood by all versions. The instance disconnects without replying.
+inline DWORD kill(DWORD procId, const Deadline & deadline) {
+    return execOnPipe(procId, "stop", deadline, [] (PipeConnection &) {});
+}
+
+inline DWORD queryStats(InstanceTransport auto & transport, DWORD procId, const Deadline & deadline, StatsReply & reply) {
+    auto request = makeMessage<StatsRequest>();
+    return callInstance(transport, procId, messageBytes(request), deadline, reply);
+}
+
+inline DWORD queryLeases(InstanceTransport auto & transport, DWORD procId, const Deadline & deadline, std::vector<LeaseInfo> & leases) {
+    auto request = makeMessage<ListLeasesRequest>();
+    auto reply = std::make_unique<ListLeasesReply>();
+    while (true) {
+        if (auto err = callInstance(transport, procId, messageBytes(request), deadline, *reply); err != ERROR_SUCCESS)
+            return err;
+        auto count = std::min(size_t(reply->count), std::size(reply->leases));
+        leases.insert(leases.end(), reply->leases, reply->leases + count);
+        if (!reply->more || count == 0)
+            return ERROR_SUCCESS;
+        request.firstLease = reply->leases[count - 1].leaseId + 1;
+    }
+}
+
+inline DWORD releaseLease(InstanceTransport auto & transport, DWORD procId, DWORD leaseId, const Deadline & deadline) {
+    auto request = makeMessage<ReleaseLeaseRequest>();
+    request.leaseId = leaseId;
+    ErrorReply reply;
+    if (auto err = callInstance(transport, procId, messageBytes(request), deadline, reply); err != ERROR_SUCCESS)
+        return err;
+    return reply.code;
+}
+
+// Changes the deadline of an instance or one of its leases. On success reply describes the new state.
+inline DWORD setDeadline(InstanceTransport auto & transport, DWORD procId, std::optional<DWORD> leaseId, 
+                         DeadlineChange change, ULONGLONG durationMs, const Deadline & deadline, InfoReply & reply) {
+    auto request = makeMessage<SetDeadlineRequest>();
+    request.durationMs = durationMs;
+    request.change = change;
+    request.leaseId = leaseId.value_or(0);
+    return callInstance(transport, procId, messageBytes(request), deadline, reply);
+}
+
+struct InstanceEntry {
+    DWORD pid = 0;
+    std::optional<DWORD> leaseId;       //brokers are listed as their individual leases
+    DWORD sessionId = 0;
+    PSID userSid = nullptr;
+    QueryResult<InstanceInfo> info;
+    std::optional<ULONGLONG> queryUs;   //how long querying the instance took, none if it was not queried
+};
+
+struct InstanceList {
+    std::vector<InstanceEntry> entries;
+    bool needsQuery = false;    //entries only have pid, session and user
+
+    //storage entries point into
+    std::vector<RegistryRecord> records;
+    std::unique_ptr<WTS_PROCESS_INFO[], WTSDeleter> processes;
+};
+
+// Finds instances without querying them. Instances found in the registry are already complete. 
+// Without a registry running processes are enumerated instead and need to be queried.
+inline InstanceList enumerateInstances(InstanceRegistry * registry) {
+    InstanceList ret;
+
+    if (registry) {
+        registry->forEachLive([&](const RegistryRecord & record) {
+            ret.records.push_back(record);
+        });
+        auto now = GetTickCount64();
+        for (auto & record: ret.records) {
+            //expired instances are about to exit
+            if (record.deadlineTick <= now)
+                continue;
+            auto & entry = ret.entries.emplace_back();
+            entry.pid = record.pid;
+            entry.sessionId = record.sessionId;
+            entry.userSid = IsValidSid(record.userSid) ? PSID(record.userSid) : nullptr;
+            entry.info.status = QueryStatus::success;
+            entry.info.value.remainingMs = record.deadlineTick == g_infiniteTick ? g_protocolInfinite : record.deadlineTick - now;
+            entry.info.value.deadline = wallDeadline(entry.info.value.remainingMs);
+            entry.info.value.ageMs = now - std::min(now, record.startTick);
+            entry.info.value.broker = (record.flags & registryBroker) != 0;
+        }
+    } else {
+        DWORD count;
+        if (!WTSEnumerateProcesses(WTS_CURRENT_SERVER_HANDLE, 0, 1, std::out_ptr(ret.processes), &count))
+            throwLastError("WTSEnumerateProcesses");
+
+        auto mypid = GetCurrentProcessId();
+        for(DWORD i = 0; i < count; ++i) {
+            auto & info = ret.processes[i];
+            if (info.ProcessId != mypid && info.pProcessName == std::wstring_view(L"keep-awake.exe")) {
+                auto & entry = ret.entries.emplace_back();
+                entry.pid = info.ProcessId;
+                entry.sessionId = info.SessionId;
+                entry.userSid = info.pUserSid;
+            }
+        }
+        ret.needsQuery = true;
+    }
+    return ret;
+}
+
+// Queries instances in parallel where necessary and calls sink(InstanceEntry &&) for every resulting 
+// entry as soon as it is known. Brokers are replaced by their leases. Every instance gets its own 
+// deadline within limits so that one that hangs does not hold up the others. Calls to sink are serialized.
+inline void queryInstances(InstanceTransport auto & transport, const InstanceList & instances, const QueryLimits & limits, auto && sink) {
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < instances.entries.size(); ++i) {
+        auto & entry = instances.entries[i];
+        if (instances.needsQuery || entry.info.value.broker)
+            pending.push_back(i);
+        else
+            sink(InstanceEntry(entry));
+    }
+
+    auto overall = Deadline::after(limits.total);
+    std::mutex sinkMutex;
+    forEachParallel(pending.size(), [&](size_t idx) {
+        auto entry = instances.entries[pending[idx]];
+        auto start = std::chrono::steady_clock::now();
+        if (instances.needsQuery)
+            entry.info.status = queryStatusFromError(getInfo(transport, entry.pid, limits.deadlineFor(overall), entry.info.value));
+
+        std::vector<LeaseInfo> leases;
+        bool hasLeases = entry.info.status == QueryStatus::success && entry.info.value.broker && 
+                         queryLeases(transport, entry.pid, limits.deadlineFor(overall), leases) == ERROR_SUCCESS;
+        entry.queryUs = ULONGLONG(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+        if (hasLeases) {
+            std::lock_guard lock(sinkMutex);
+            for (auto & lease: leases) {
+                auto leaseEntry = entry;
+                leaseEntry.leaseId = lease.leaseId;
+                leaseEntry.info.value = infoFromLease(lease);
+                sink(std::move(leaseEntry));
+            }
+            return;
+        }
+        //brokers whose leases cannot be listed are reported as a whole
+        std::lock_guard lock(sinkMutex);
+        sink(std::move(entry));
+    });
+}
+
+#pragma endregion
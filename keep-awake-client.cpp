@@ -0,0 +1,340 @@
+#include "keep-awake-client.h"
+#include "instance-control.h"
+
+using namespace std::literals;
+
+namespace KeepAwake {
+
+// Instances close connections that stay idle for 5 seconds so don't try to reuse ones close to that
+constexpr ULONGLONG g_reuseWindow = 4'000;
+constexpr size_t g_maxIdleConnections = 32;
+
+static std::unexpected<std::error_code> failure(DWORD err) {
+    return std::unexpected(std::error_code(int(err), std::system_category()));
+}
+
+template<class T>
+static Result<T> guarded(auto && op) noexcept {
+    try {
+        return op();
+    } catch (std::system_error & ex) {
+        return std::unexpected(ex.code());
+    } catch (std::bad_alloc &) {
+        return failure(ERROR_NOT_ENOUGH_MEMORY);
+    } catch (std::exception &) {
+        return failure(ERROR_INTERNAL_ERROR);
+    }
+}
+
+static std::chrono::milliseconds toMilliseconds(ULONGLONG ms) {
+    return std::chrono::milliseconds(std::chrono::milliseconds::rep(ms));
+}
+
+static std::chrono::system_clock::time_point fromFileTime(ULONGLONG ft) {
+    return std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(toMilliseconds(fileTimeToUnixMs(ft))));
+}
+
+static std::wstring sidToString(PSID sid) {
+    unqiue_local_membuf<wchar_t> str;
+    if (!sid || !IsValidSid(sid) || !ConvertSidToStringSidW(sid, std::out_ptr(str)))
+        return {};
+    return str.get();
+}
+
+static InstanceStatus statusFromInfo(InstanceId id, const InstanceInfo & info) {
+    InstanceStatus ret;
+    ret.id = id;
+    if (info.remainingMs != g_protocolInfinite) {
+        ret.remaining = toMilliseconds(info.remainingMs);
+        if (info.deadline)
+            ret.deadline = fromFileTime(*info.deadline);
+    }
+    if (info.ageMs) {
+        auto now = wallClockNow();
+        ret.started = fromFileTime(now - std::min(now, *info.ageMs * 10'000));
+    }
+    ret.shared = info.broker;
+    return ret;
+}
+
+static void CALLBACK resumeAwaiter(PTP_CALLBACK_INSTANCE instance, void * context, PTP_WORK work) noexcept {
+    CloseThreadpoolWork(work);
+    //the coroutine runs on from here for as long as it likes
+    CallbackMayRunLong(instance);
+    std::coroutine_handle<>::from_address(context).resume();
+}
+
+void * Detail::prepareResume(std::coroutine_handle<> awaiter) {
+    //no callback environment: the work is not in any client's cleanup group so the resumed coroutine
+    //can destroy the client without waiting for its own callback
+    auto work = CreateThreadpoolWork(resumeAwaiter, awaiter.address(), nullptr);
+    if (!work)
+        throwLastError("CreateThreadpoolWork");
+    return work;
+}
+
+void Detail::postResume(void * work) noexcept {
+    SubmitThreadpoolWork(static_cast<PTP_WORK>(work));
+}
+
+void Detail::discardResume(void * work) noexcept {
+    CloseThreadpoolWork(static_cast<PTP_WORK>(work));
+}
+
+class Client::Impl {
+public:
+    explicit Impl(Options options):
+        m_options(options)
+    {
+        InitializeThreadpoolEnvironment(&m_env);
+        m_cleanup = CreateThreadpoolCleanupGroup();
+        if (!m_cleanup)
+            throwLastError("CreateThreadpoolCleanupGroup");
+        SetThreadpoolCallbackCleanupGroup(&m_env, m_cleanup, nullptr);
+    }
+
+    ~Impl() noexcept {
+        CloseThreadpoolCleanupGroupMembers(m_cleanup, false, nullptr);
+        CloseThreadpoolCleanupGroup(m_cleanup);
+        DestroyThreadpoolEnvironment(&m_env);
+    }
+    Impl(const Impl &) = delete;
+    Impl & operator=(const Impl &) = delete;
+
+    // Runs op(deadline) on the thread pool and passes the result to callback
+    template<class T>
+    void submit(std::invocable<const Deadline &> auto && op, Callback<T> callback) {
+        auto timeout = std::max(m_options.timeout.count(), std::chrono::milliseconds::rep(0));
+        auto work = std::make_unique<Work>([deadline = Deadline::after(ULONGLONG(timeout)),
+                                            op = std::forward<decltype(op)>(op),
+                                            callback = std::move(callback)]() {
+            callback(guarded<T>([&]() { return op(deadline); }));
+        });
+        if (!TrySubmitThreadpoolCallback(run, work.get(), &m_env))
+            throwLastError("TrySubmitThreadpoolCallback");
+        work.release();
+    }
+
+    Result<InstanceStatus> query(InstanceId id, const Deadline & deadline) {
+        if (id.lease) {
+            std::vector<LeaseInfo> leases;
+            if (auto err = queryLeases(*this, id.pid, deadline, leases); err != ERROR_SUCCESS)
+                return failure(err);
+            auto it = std::ranges::find(leases, *id.lease, &LeaseInfo::leaseId);
+            if (it == leases.end())
+                return failure(ERROR_NOT_FOUND);
+            return statusFromInfo(id, infoFromLease(*it));
+        }
+        InstanceInfo info;
+        if (auto err = getInfo(*this, id.pid, deadline, info); err != ERROR_SUCCESS)
+            return failure(err);
+        return statusFromInfo(id, info);
+    }
+
+    Result<void> stop(InstanceId id, const Deadline & deadline) {
+        if (id.lease) {
+            if (auto err = releaseLease(*this, id.pid, *id.lease, deadline); err != ERROR_SUCCESS)
+                return failure(err);
+            return {};
+        }
+        dropIdle(id.pid);
+        if (auto err = kill(id.pid, deadline); err != ERROR_SUCCESS)
+            return failure(err);
+        return {};
+    }
+
+    Result<InstanceStatus> setDeadline(InstanceId id, DeadlineChange change, std::chrono::milliseconds duration,
+                                       const Deadline & deadline) {
+        auto durationMs = ULONGLONG(std::max(duration.count(), std::chrono::milliseconds::rep(0)));
+        InfoReply reply;
+        if (auto err = ::setDeadline(*this, id.pid, id.lease, change, durationMs, deadline, reply); err != ERROR_SUCCESS)
+            return failure(err);
+        return statusFromInfo(id, infoFromReply(reply));
+    }
+
+    Result<std::vector<InstanceEntry>> enumerate(const Deadline & deadline) {
+        InstanceList instances;
+        {
+            std::lock_guard lock(m_registryMutex);
+            instances = enumerateInstances(openRegistry());
+        }
+
+        QueryLimits limits;
+        limits.total = deadline.remaining();
+        std::vector<InstanceEntry> ret;
+        queryInstances(*this, instances, limits, [&](::InstanceEntry && found) {
+            //instances that do not respond in time are left out
+            if (found.info.status != QueryStatus::success)
+                return;
+            auto & entry = ret.emplace_back();
+            entry.status = statusFromInfo({found.pid, found.leaseId}, found.info.value);
+            entry.sessionId = found.sessionId;
+            entry.userSid = sidToString(found.userSid);
+        });
+        std::ranges::sort(ret, {}, [](const InstanceEntry & entry) { 
+            return std::pair(entry.status.id.pid, entry.status.id.lease.value_or(0)); 
+        });
+        return ret;
+    }
+
+    // Sends a request and reads the reply into buf. An idle connection to the instance is reused if
+    // there is one. The connection is kept for reuse afterwards.
+    DWORD exchange(DWORD pid, std::string_view request, const Deadline & deadline, std::span<char> buf, std::string_view & reply) {
+        if (auto conn = takeIdle(pid)) {
+            conn->setDeadline(deadline);
+            auto err = transact(*conn, request, buf, reply);
+            if (err == ERROR_SUCCESS)
+                putIdle(pid, std::move(conn));
+            //otherwise the instance may have closed the connection just as we reused it
+            if (!isDisconnect(err))
+                return err;
+        }
+        auto conn = std::make_unique<PipeConnection>(deadline);
+        auto err = conn->open(pid);
+        if (err == ERROR_SUCCESS)
+            err = transact(*conn, request, buf, reply);
+        if (err == ERROR_SUCCESS)
+            putIdle(pid, std::move(conn));
+        return err;
+    }
+
+private:
+    using Work = std::function<void ()>;
+
+    struct IdleConnection {
+        DWORD pid;
+        ULONGLONG since;
+        std::unique_ptr<PipeConnection> conn;
+    };
+
+    static void CALLBACK run(PTP_CALLBACK_INSTANCE instance, void * context) noexcept {
+        std::unique_ptr<Work> work(static_cast<Work *>(context));
+        //operations block on pipe I/O for up to their timeout
+        CallbackMayRunLong(instance);
+        (*work)();
+    }
+
+    static DWORD transact(PipeConnection & conn, std::string_view request, std::span<char> buf, std::string_view & reply) {
+        if (auto err = conn.write(request); err != ERROR_SUCCESS)
+            return err;
+        size_t size;
+        if (auto err = conn.read(buf, size); err != ERROR_SUCCESS)
+            return err;
+        reply = std::string_view(buf.data(), size);
+        return ERROR_SUCCESS;
+    }
+
+    std::unique_ptr<PipeConnection> takeIdle(DWORD pid) {
+        std::lock_guard lock(m_mutex);
+        auto now = GetTickCount64();
+        std::erase_if(m_idle, [now](const IdleConnection & idle) { return now - idle.since >= g_reuseWindow; });
+        auto it = std::ranges::find(m_idle, pid, &IdleConnection::pid);
+        if (it == m_idle.end())
+            return nullptr;
+        auto ret = std::move(it->conn);
+        m_idle.erase(it);
+        return ret;
+    }
+
+    void putIdle(DWORD pid, std::unique_ptr<PipeConnection> conn) {
+        std::lock_guard lock(m_mutex);
+        if (m_idle.size() == g_maxIdleConnections)
+            m_idle.erase(m_idle.begin());
+        m_idle.push_back({pid, GetTickCount64(), std::move(conn)});
+    }
+
+    void dropIdle(DWORD pid) {
+        std::lock_guard lock(m_mutex);
+        std::erase_if(m_idle, [pid](const IdleConnection & idle) { return idle.pid == pid; });
+    }
+
+    // Opened on first use and kept mapped for the lifetime of the client
+    InstanceRegistry * openRegistry() {
+        std::lock_guard lock(m_mutex);
+        if (!m_registry)
+            m_registry = InstanceRegistry::open();
+        return m_registry.get();
+    }
+
+private:
+    Options m_options;
+    TP_CALLBACK_ENVIRON m_env;
+    PTP_CLEANUP_GROUP m_cleanup = nullptr;
+    std::mutex m_mutex;
+    std::mutex m_registryMutex;             //the registry is read by one operation at a time
+    std::vector<IdleConnection> m_idle;     //oldest first
+    std::unique_ptr<InstanceRegistry> m_registry;
+};
+
+Client::Client():
+    Client(Options{})
+{}
+
+Client::Client(Options options):
+    m_impl(std::make_unique<Impl>(options))
+{}
+
+Client::~Client() noexcept = default;
+
+void Client::query(InstanceId id, Callback<InstanceStatus> callback) {
+    m_impl->submit<InstanceStatus>([impl = m_impl.get(), id](const Deadline & deadline) {
+        return impl->query(id, deadline);
+    }, std::move(callback));
+}
+
+Operation<InstanceStatus> Client::query(InstanceId id) {
+    return Operation<InstanceStatus>([this, id](Callback<InstanceStatus> callback) {
+        query(id, std::move(callback));
+    });
+}
+
+void Client::stop(InstanceId id, Callback<void> callback) {
+    m_impl->submit<void>([impl = m_impl.get(), id](const Deadline & deadline) {
+        return impl->stop(id, deadline);
+    }, std::move(callback));
+}
+
+Operation<void> Client::stop(InstanceId id) {
+    return Operation<void>([this, id](Callback<void> callback) {
+        stop(id, std::move(callback));
+    });
+}
+
+void Client::extend(InstanceId id, std::chrono::milliseconds by, Callback<InstanceStatus> callback) {
+    m_impl->submit<InstanceStatus>([impl = m_impl.get(), id, by](const Deadline & deadline) {
+        return impl->setDeadline(id, DeadlineChange::extend, by, deadline);
+    }, std::move(callback));
+}
+
+Operation<InstanceStatus> Client::extend(InstanceId id, std::chrono::milliseconds by) {
+    return Operation<InstanceStatus>([this, id, by](Callback<InstanceStatus> callback) {
+        extend(id, by, std::move(callback));
+    });
+}
+
+void Client::setRemaining(InstanceId id, std::chrono::milliseconds remaining, Callback<InstanceStatus> callback) {
+    m_impl->submit<InstanceStatus>([impl = m_impl.get(), id, remaining](const Deadline & deadline) {
+        return impl->setDeadline(id, DeadlineChange::setRemaining, remaining, deadline);
+    }, std::move(callback));
+}
+
+Operation<InstanceStatus> Client::setRemaining(InstanceId id, std::chrono::milliseconds remaining) {
+    return Operation<InstanceStatus>([this, id, remaining](Callback<InstanceStatus> callback) {
+        setRemaining(id, remaining, std::move(callback));
+    });
+}
+
+void Client::enumerate(Callback<std::vector<InstanceEntry>> callback) {
+    m_impl->submit<std::vector<InstanceEntry>>([impl = m_impl.get()](const Deadline & deadline) {
+        return impl->enumerate(deadline);
+    }, std::move(callback));
+}
+
+Operation<std::vector<InstanceEntry>> Client::enumerate() {
+    return Operation<std::vector<InstanceEntry>>([this](Callback<std::vector<InstanceEntry>> callback) {
+        enumerate(std::move(callback));
+    });
+}
+
+}
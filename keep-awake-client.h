@@ -0,0 +1,149 @@
+#pragma once
+
+// Client library for controlling running keep-awake instances from other programs.
+//
+// Instances are found via the instance registry and controlled over their pipes using the binary
+// control protocol. Connections are kept open for a few seconds after
+// each request and reused by further requests to the same instance.
+//
+// Every operation runs on the Windows thread pool and completes within the client's timeout. Each
+// one comes in two forms: one takes a callback that is invoked with the result on a thread pool thread,
+// the other returns an awaitable that resumes the awaiting coroutine with the result on a thread pool
+// thread. Callbacks must not throw. Awaiting coroutines are resumed outside of the client's own callbacks
+// so they are free to destroy the client once resumed.
+//
+// Errors are Win32 error codes in std::system_category(), most notably ERROR_TIMEOUT, ERROR_ACCESS_DENIED,
+// ERROR_FILE_NOT_FOUND if there is no such instance, ERROR_NOT_FOUND if there is no such lease and
+// ERROR_NOT_SUPPORTED if the instance was started by a version that does not support the operation.
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <expected>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace KeepAwake {
+
+template<class T>
+using Result = std::expected<T, std::error_code>;
+
+template<class T>
+using Callback = std::function<void (Result<T>)>;
+
+// An instance or a lease of a shared instance
+struct InstanceId {
+    std::uint32_t pid = 0;
+    std::optional<std::uint32_t> lease;
+
+    friend bool operator==(const InstanceId &, const InstanceId &) = default;
+};
+
+struct InstanceStatus {
+    InstanceId id;
+    std::optional<std::chrono::milliseconds> remaining;             //none if it runs until stopped
+    std::optional<std::chrono::system_clock::time_point> deadline;  //none if it runs until stopped
+    std::optional<std::chrono::system_clock::time_point> started;   //none for instances started by older versions
+    bool shared = false;                                            //a shared instance or its lease
+};
+
+// An instance, or a lease of a shared instance, found by Client::enumerate()
+struct InstanceEntry {
+    InstanceStatus status;
+    std::uint32_t sessionId = 0;
+    std::wstring userSid;                                           //in S-1-... form
+};
+
+namespace Detail {
+    // Resuming a coroutine via thread pool work that does not belong to any Client. prepareResume() can fail
+    // and is called before an operation starts, postResume() cannot and is called once it completes.
+    void * prepareResume(std::coroutine_handle<> awaiter);
+    void postResume(void * work) noexcept;
+    void discardResume(void * work) noexcept;
+}
+
+// Awaitable result of a Client operation. The operation starts when it is awaited.
+template<class T>
+class Operation {
+public:
+    Operation(Operation &&) noexcept = default;
+    Operation(const Operation &) = delete;
+    Operation & operator=(const Operation &) = delete;
+
+    bool await_ready() const noexcept
+        { return false; }
+
+    void await_suspend(std::coroutine_handle<> awaiter) {
+        //the awaiter may be resumed, and this object destroyed, before start returns
+        auto start = std::move(m_start);
+        auto resume = Detail::prepareResume(awaiter);
+        try {
+            start([this, resume](Result<T> result) {
+                m_result.emplace(std::move(result));
+                Detail::postResume(resume);
+            });
+        } catch (...) {
+            Detail::discardResume(resume);
+            throw;
+        }
+    }
+
+    Result<T> await_resume()
+        { return std::move(*m_result); }
+
+private:
+    friend class Client;
+
+    explicit Operation(std::function<void (Callback<T>)> start):
+        m_start(std::move(start))
+    {}
+private:
+    std::function<void (Callback<T>)> m_start;
+    std::optional<Result<T>> m_result;
+};
+
+class Client {
+public:
+    struct Options {
+        std::chrono::milliseconds timeout{2'000};   //for each operation
+    };
+
+    Client();
+    explicit Client(Options options);
+    // Waits for operations in progress to complete. Must not be called from a callback passed to this client
+    // but may be called from a coroutine resumed by one of its awaitables.
+    ~Client() noexcept;
+    Client(const Client &) = delete;
+    Client & operator=(const Client &) = delete;
+
+    // Remaining time of an instance or a lease
+    void query(InstanceId id, Callback<InstanceStatus> callback);
+    Operation<InstanceStatus> query(InstanceId id);
+
+    // Stops an instance or releases a lease. Stopping a shared instance releases all its leases.
+    void stop(InstanceId id, Callback<void> callback);
+    Operation<void> stop(InstanceId id);
+
+    // Adds to the remaining time. Instances and leases without a deadline are not affected.
+    void extend(InstanceId id, std::chrono::milliseconds by, Callback<InstanceStatus> callback);
+    Operation<InstanceStatus> extend(InstanceId id, std::chrono::milliseconds by);
+
+    // Replaces the remaining time, giving a deadline to instances and leases without one
+    void setRemaining(InstanceId id, std::chrono::milliseconds remaining, Callback<InstanceStatus> callback);
+    Operation<InstanceStatus> setRemaining(InstanceId id, std::chrono::milliseconds remaining);
+
+    // All running instances, with shared instances listed as their individual leases. Like `keep-awake list`
+    // this reads the instance registry and only enumerates processes if the registry is not available.
+    void enumerate(Callback<std::vector<InstanceEntry>> callback);
+    Operation<std::vector<InstanceEntry>> enumerate();
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+}
@@ -0,0 +1,119 @@
+#include "keep-awake-scope.h"
+#include "win32-utils.h"
+
+namespace KeepAwake {
+
+// Default inhibitor. Unlike SetThreadExecutionState used by keep-awake itself, a power request is not
+// tied to the thread that set it so scopes can end on a different thread than the one they started on.
+class PowerRequestInhibitor final : public Inhibitor {
+public:
+    void acquire() override {
+        if (!m_request) {
+            REASON_CONTEXT reason{};
+            reason.Version = POWER_REQUEST_CONTEXT_VERSION;
+            reason.Flags = POWER_REQUEST_CONTEXT_SIMPLE_STRING;
+            reason.Reason.SimpleReasonString = const_cast<wchar_t *>(L"keep-awake");
+            m_request = PowerCreateRequest(&reason);
+            if (!m_request)
+                throwLastError("PowerCreateRequest");
+        }
+        if (!PowerSetRequest(m_request.get(), PowerRequestSystemRequired))
+            throwLastError("PowerSetRequest");
+    }
+
+    void release() noexcept override {
+        PowerClearRequest(m_request.get(), PowerRequestSystemRequired);
+    }
+
+private:
+    AutoFile m_request;
+};
+
+// Scopes of the whole process.
+//
+// The count is updated without locking. Only when a scope finds the inhibitor in the wrong state, which
+// happens when the count goes between 0 and 1, is the lock taken to bring the inhibitor in line with the
+// count as it is then. Thus racing transitions on different threads cannot leave it in the wrong state.
+class ScopeCount {
+public:
+    void acquire() {
+        if (m_count.fetch_add(1, std::memory_order_acq_rel) != 0 && m_active.load(std::memory_order_acquire))
+            return;
+        try {
+            activate();
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    void release() noexcept {
+        if (m_count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            deactivate();
+    }
+
+    void setInhibitor(Inhibitor * inhibitor) noexcept {
+        std::lock_guard lock(m_mutex);
+        m_inhibitor = inhibitor ? inhibitor : &m_default;
+    }
+
+private:
+    void activate() {
+        std::lock_guard lock(m_mutex);
+        if (m_active.load(std::memory_order_relaxed) || m_count.load(std::memory_order_acquire) == 0)
+            return;
+        m_inhibitor->acquire();
+        m_active.store(true, std::memory_order_release);
+    }
+
+    void deactivate() noexcept {
+        std::lock_guard lock(m_mutex);
+        if (!m_active.load(std::memory_order_relaxed) || m_count.load(std::memory_order_acquire) != 0)
+            return;
+        m_inhibitor->release();
+        m_active.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<size_t> m_count = 0;
+    std::atomic<bool> m_active = false;     //only changed with m_mutex held
+    std::mutex m_mutex;
+    PowerRequestInhibitor m_default;
+    Inhibitor * m_inhibitor = &m_default;
+};
+
+static ScopeCount & scopes() {
+    static ScopeCount instance;
+    return instance;
+}
+
+void setInhibitor(Inhibitor * inhibitor) noexcept {
+    scopes().setInhibitor(inhibitor);
+}
+
+ScopedKeepAwake::ScopedKeepAwake() {
+    scopes().acquire();
+}
+
+ScopedKeepAwake::~ScopedKeepAwake() noexcept {
+    scopes().release();
+}
+
+}
+
+unsigned long keep_awake_acquire(void) {
+    try {
+        KeepAwake::scopes().acquire();
+        return ERROR_SUCCESS;
+    } catch (std::system_error & ex) {
+        return DWORD(ex.code().value());
+    } catch (std::bad_alloc &) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    } catch (std::exception &) {
+        return ERROR_INTERNAL_ERROR;
+    }
+}
+
+void keep_awake_release(void) {
+    KeepAwake::scopes().release();
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+// Keeps the machine awake from within a program, without starting keep-awake.
+//
+// Every scope, be it a ScopedKeepAwake object or a keep_awake_acquire() call, holds a reference to one
+// process-wide inhibitor, by default a system-required power request. Scopes can be nested and can overlap
+// across threads. Only the scope that starts first and the one that ends last call into the system, the
+// others merely update an atomic count.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Starts a scope. Returns 0 on success or a Win32 error code.
+// Every successful call must be paired with a call to keep_awake_release().
+unsigned long keep_awake_acquire(void);
+
+// Ends a scope started by keep_awake_acquire(). It does not need to be called on the same thread.
+void keep_awake_release(void);
+
+#ifdef __cplusplus
+}
+
+namespace KeepAwake {
+
+// What keeps the machine awake while any scope is active. Its methods are never called concurrently.
+class Inhibitor {
+public:
+    virtual ~Inhibitor() noexcept = default;
+
+    // Called when the first scope starts. Throws std::system_error on failure.
+    virtual void acquire() = 0;
+    // Called when the last scope ends
+    virtual void release() noexcept = 0;
+};
+
+// Replaces the inhibitor used by all scopes, nullptr restores the default. Must only be called while
+// no scope is active and the inhibitor must stay alive for as long as it is in use.
+void setInhibitor(Inhibitor * inhibitor) noexcept;
+
+class ScopedKeepAwake {
+public:
+    // Throws std::system_error if the machine cannot be kept awake
+    ScopedKeepAwake();
+    ~ScopedKeepAwake() noexcept;
+    ScopedKeepAwake(const ScopedKeepAwake &) = delete;
+    ScopedKeepAwake & operator=(const ScopedKeepAwake &) = delete;
+};
+
+}
+
+#endif
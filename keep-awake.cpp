@@ -1,9 +1,9 @@
+#include "win32-utils.h"
+#include "instance-control.h"
+
 using namespace Argum;
 using namespace std::literals;
 
-constexpr auto g_maxDuration = std::numeric_limits<ULONGLONG>::max() / 1000;
-constexpr auto g_myGuid = L"BAF0674F-E091-468A-AAA9-234909F4CFFB";
-
 #define KA_COLOR_PID Color::bold, Color::cyan
 #define KA_COLOR_DURATION Color::bold, Color::magenta
 #define KA_COLOR_USER Color::bold, Color::bright_blue
@@ -23,155 +23,243 @@ constexpr auto g_myGuid = L"BAF0674F-E091-468A-AAA9-234909F4CFFB";
 #define KA_COLOR_HELP_LONGOPT Color::bold, Color::cyan
 #define KA_COLOR_HELP_SHORTOPT Color::bold, Color::green
 
-#pragma region General Win32 Utilities
+#pragma region Tracing
 
-static std::wstring widen(std::string_view str) {
-    int size_needed = MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), nullptr, 0);
-    std::wstring ret(size_needed, 0);
-    MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), ret.data(), size_needed);
-    return ret;
-}
+// Optional timing spans for --trace in Chrome trace-event JSON.
+//
+// Each completed span is appended to the file by a single write so the launcher and the background
+// instance can share one file from any thread, and nothing is lost if a process is killed. 
+// The closing ']' is optional in this format so the file is valid at any point. 
+// Building without KEEP_AWAKE_TRACING turns all of this into no-ops.
 
-static std::string narrow(std::wstring_view str) {
-    int size_needed = WideCharToMultiByte(CP_UTF8, 0, str.data(), int(str.size()), nullptr, 0, nullptr, nullptr);
-    std::string ret(size_needed, 0);
-    WideCharToMultiByte(CP_UTF8, 0, str.data(), int(str.size()), ret.data(), size_needed, nullptr, nullptr);
-    return ret;
+#ifndef KEEP_AWAKE_TRACING
+    #define KEEP_AWAKE_TRACING 0
+#endif
+
+// Environment variable that passes the trace file to the background instance
+static std::wstring traceEnvVarName() {
+    return std::format(L"{}-TRACE", g_myGuid);
 }
 
-template<uintptr_t InvalidValue>
-class BasicAutoHandle {
+#if KEEP_AWAKE_TRACING
+
+class Tracer {
 public:
-    BasicAutoHandle() noexcept = default;
-    BasicAutoHandle(HANDLE h) noexcept :
-        m_handle(h)
-    {}
-    ~BasicAutoHandle() noexcept {
-        if (m_handle != HANDLE(InvalidValue))
-            CloseHandle(m_handle);
+    // The launcher creates the file, the background instance appends to it
+    static void start(const std::wstring & path, bool create) {
+        HANDLE file = CreateFileW(path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                  create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throwLastError("CreateFile(trace file)");
+        if (create) {
+            DWORD written;
+            WriteFile(file, "[\n", 2, &written, nullptr);
+        }
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        s_frequency = freq.QuadPart;
+        s_path = path;
+        //never closed: spans may complete on detached threads until the process exits
+        s_file.store(file, std::memory_order_release);
+    }
+
+    static bool enabled() noexcept
+        { return s_file.load(std::memory_order_relaxed) != nullptr; }
+    static const std::wstring & path() noexcept
+        { return s_path; }
+
+    static LONGLONG now() noexcept {
+        LARGE_INTEGER ret;
+        QueryPerformanceCounter(&ret);
+        return ret.QuadPart;
     }
-    BasicAutoHandle(BasicAutoHandle && src) noexcept : 
-        m_handle(std::exchange(src.m_handle, HANDLE(InvalidValue)))
+
+    // name and argName must be JSON-safe literals
+    static void record(const char * name, LONGLONG start, LONGLONG end, const char * argName = nullptr, ULONGLONG argValue = 0) noexcept {
+        auto file = s_file.load(std::memory_order_acquire);
+        if (!file)
+            return;
+        char buf[256];
+        auto out = std::format_to_n(buf, sizeof(buf) - 8, R"({{"name":"{}","ph":"X","ts":{},"dur":{},"pid":{},"tid":{})",
+                                    name, micros(start), micros(end) - micros(start), GetCurrentProcessId(), GetCurrentThreadId()).out;
+        if (argName)
+            out = std::format_to_n(out, buf + sizeof(buf) - 8 - out, R"(,"args":{{"{}":{}}})", argName, argValue).out;
+        out = std::ranges::copy("},\n"sv, out).out;
+        DWORD written;
+        WriteFile(file, buf, DWORD(out - buf), &written, nullptr);
+    }
+private:
+    static ULONGLONG micros(LONGLONG ticks) noexcept 
+        { return ULONGLONG(ticks / s_frequency) * 1'000'000 + ULONGLONG(ticks % s_frequency) * 1'000'000 / s_frequency; }
+private:
+    static inline std::atomic<HANDLE> s_file = nullptr;
+    static inline LONGLONG s_frequency = 1;
+    static inline std::wstring s_path;
+};
+
+// Records the time from construction to destruction when tracing is on
+class TraceSpan {
+public:
+    TraceSpan(const char * name, const char * argName = nullptr, ULONGLONG argValue = 0) noexcept:
+        m_name(name),
+        m_argName(argName),
+        m_argValue(argValue),
+        m_start(Tracer::enabled() ? Tracer::now() : 0)
     {}
-    BasicAutoHandle & operator=(BasicAutoHandle && src) noexcept {
-        if (m_handle != HANDLE(InvalidValue))
-            CloseHandle(m_handle);
-        m_handle = std::exchange(src.m_handle, HANDLE(InvalidValue));
-        return *this;
-    }
-    BasicAutoHandle(const BasicAutoHandle &) = delete;
-    BasicAutoHandle & operator=(const BasicAutoHandle &) = delete;
-
-    HANDLE get() const 
-        { return m_handle; }
-    HANDLE & out() 
-        { return m_handle; }
-    void reset() {
-        if (m_handle != HANDLE(InvalidValue)) {
-            CloseHandle(m_handle);
-            m_handle = HANDLE(InvalidValue);
-        }
-    }
-    explicit operator bool() const 
-        { return m_handle != HANDLE(InvalidValue); }
+    ~TraceSpan() noexcept {
+        if (m_start)
+            Tracer::record(m_name, m_start, Tracer::now(), m_argName, m_argValue);
+    }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan & operator=(const TraceSpan &) = delete;
 private:
-    HANDLE m_handle = HANDLE(InvalidValue);
+    const char * m_name;
+    const char * m_argName;
+    ULONGLONG m_argValue;
+    LONGLONG m_start;
 };
 
-using AutoHandle = BasicAutoHandle<0>;
-using AutoFile = BasicAutoHandle<uintptr_t(-1)>;
+#else
 
-struct LocalAllocDeleter {
-	void operator()(void * ptr) { LocalFree(ptr); }
+class Tracer {
+public:
+    static void start(const std::wstring &, bool) {}
+    static bool enabled() noexcept 
+        { return false; }
+    static const std::wstring & path() noexcept 
+        { static const std::wstring empty; return empty; }
+    static LONGLONG now() noexcept 
+        { return 0; }
+    static void record(const char *, LONGLONG, LONGLONG, const char * = nullptr, ULONGLONG = 0) noexcept {}
 };
 
-template<class T>
-requires(
-	(!std::is_array_v<T> && std::is_trivially_destructible_v<T>) ||
-	(std::is_array_v<T> && std::is_trivially_destructible_v<std::remove_all_extents_t<T>>)
-)
-using unqiue_local_membuf = std::unique_ptr<T, LocalAllocDeleter>;
-
-struct WTSDeleter {
-    void operator()(void * ptr) { if (ptr) WTSFreeMemory(ptr); }
+class TraceSpan {
+public:
+    TraceSpan(const char *, const char * = nullptr, ULONGLONG = 0) noexcept {}
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan & operator=(const TraceSpan &) = delete;
 };
 
-//static std::wstring win32ErrorMessage(DWORD err) {
-//    return widen(std::error_code(int(err), std::system_category()).message());
-//}
+#endif
 
-[[noreturn]]
-static inline void throwWin32Error(DWORD err, const char * doingWhat) {
-    throw std::system_error(std::error_code(int(err), std::system_category()), doingWhat);
-}
+#pragma endregion
 
-[[noreturn]]
-static inline void throwLastError(const char * doingWhat) {
-    throwWin32Error(GetLastError(), doingWhat);
-}
+#pragma region Helpers
 
-static std::wstring myname() {
-    std::wstring ret;
+// Buffered text output to stdout or stderr.
+//
+// Text is formatted straight into a reusable buffer and only written on flush(). A console
+// receives it as UTF-16 via WriteConsoleW. Anything else (a pipe or a file) receives it as
+// UTF-8, transcoded once per flush. The target is looked up on every flush so that
+// redirecting the CRT stream (e.g. via freopen) is respected.
+class OutputSink {
+public:
+    explicit OutputSink(int fd) noexcept:
+        m_fd(fd)
+    {}
+    ~OutputSink() noexcept 
+        { flush(); }
+    OutputSink(const OutputSink &) = delete;
+    OutputSink & operator=(const OutputSink &) = delete;
 
-    DWORD size = 32;
-    for( ; ; ) {
-        ret.resize(size);
-        auto res = GetModuleFileNameW(nullptr, ret.data(), size);
-        if (res < size) {
-            ret.resize(res);
-            break;
-        }
-        auto err = GetLastError();
-        if (err == ERROR_SUCCESS)
-            break;
-        if (err == ERROR_INSUFFICIENT_BUFFER) {
-            if (res < std::numeric_limits<DWORD>::max() / 2)
-                size *= 2;
-            else if (res < std::numeric_limits<DWORD>::max() - 32)
-                size += 32;
+    template <class... Types>
+    void print(const std::wformat_string<Types...> fmt, Types &&... args) {
+        std::format_to(std::back_inserter(m_buffer), fmt, std::forward<Types>(args)...);
+    }
+
+    void write(std::wstring_view str) 
+        { m_buffer += str; }
+
+    void flush() noexcept {
+        if (m_buffer.empty())
+            return;
+        auto handle = HANDLE(_get_osfhandle(m_fd));
+        if (handle != INVALID_HANDLE_VALUE && handle != nullptr) {
+            DWORD mode;
+            if (GetConsoleMode(handle, &mode))
+                writeConsole(handle);
             else
-                throw std::bad_alloc();
-            continue;
+                writeUtf8(handle);
         }
-        throwWin32Error(err, "GetModuleFileName(nullptr)");
+        m_buffer.clear();
     }
-    return ret;
-}
 
-static void getTokenInfo(HANDLE token, TOKEN_INFORMATION_CLASS infoClass, std::vector<BYTE> & buf) {
+    // Flushes and frees the buffers
+    void release() noexcept {
+        flush();
+        m_buffer = std::wstring();
+        m_utf8 = std::string();
+    }
 
-    while (true) {
-        DWORD size;
-        if (GetTokenInformation(token, infoClass, buf.data(), DWORD(buf.size()), &size)) {
-            buf.resize(size);
-            break;
+private:
+    void writeConsole(HANDLE handle) noexcept {
+        //large writes can fail on older consoles
+        constexpr size_t maxChunk = 16 * 1024;
+        for (std::wstring_view rest = m_buffer; !rest.empty(); ) {
+            DWORD written;
+            if (!WriteConsoleW(handle, rest.data(), DWORD(std::min(rest.size(), maxChunk)), &written, nullptr) || written == 0)
+                break;
+            rest.remove_prefix(written);
         }
-        auto err = GetLastError();
-        if (err != ERROR_INSUFFICIENT_BUFFER)
-            throwWin32Error(err, "GetTokenInformation");
-        buf.resize(size);
     }
-}
 
-#pragma endregion
+    void writeUtf8(HANDLE handle) noexcept {
+        int size = WideCharToMultiByte(CP_UTF8, 0, m_buffer.data(), int(m_buffer.size()), nullptr, 0, nullptr, nullptr);
+        if (size <= 0)
+            return;
+        try {
+            m_utf8.resize(size_t(size));
+        } catch (std::bad_alloc &) {
+            return;
+        }
+        WideCharToMultiByte(CP_UTF8, 0, m_buffer.data(), int(m_buffer.size()), m_utf8.data(), size, nullptr, nullptr);
+        for (std::string_view rest = m_utf8; !rest.empty(); ) {
+            DWORD written;
+            if (!WriteFile(handle, rest.data(), DWORD(rest.size()), &written, nullptr) || written == 0)
+                break;
+            rest.remove_prefix(written);
+        }
+    }
 
-#pragma region Helpers
+private:
+    int m_fd;
+    std::wstring m_buffer;
+    std::string m_utf8;
+};
+
+inline OutputSink g_stdout(1);
+inline OutputSink g_stderr(2);
+
+static inline OutputSink & sinkFor(FILE * fp) {
+    return fp == stderr ? g_stderr : g_stdout;
+}
 
-static std::wstring makePipeName(DWORD procId) {
-    return std::format(L"\\\\.\\pipe\\{}-{}", g_myGuid, procId);
+// Flushes pending stdout before stderr so that the two stay in order on a shared console
+static inline void flushOutput() noexcept {
+    g_stdout.flush();
+    g_stderr.flush();
 }
 
+// Output to stdout is buffered until flushed. Output to stderr is flushed right away.
 template <class... Types>
 inline void wprint(FILE* const fp, const std::wformat_string<Types...> fmt, Types &&... args) {
-    fputws(std::format(fmt, std::forward<Types>(args)...).c_str(), fp);
+    sinkFor(fp).print(fmt, std::forward<Types>(args)...);
+    if (fp == stderr)
+        flushOutput();
+}
+
+static inline void wprint(FILE* const fp, std::wstring_view str) {
+    sinkFor(fp).write(str);
+    if (fp == stderr)
+        flushOutput();
 }
 
 static inline void wprint(FILE* const fp, const std::wstring & str) {
-    fputws(str.c_str(), fp);
+    wprint(fp, std::wstring_view(str));
 }
 
 static inline void wprint(FILE* const fp, const wchar_t * str) {
-    fputws(str, fp);
+    wprint(fp, std::wstring_view(str));
 }
 
 template<Color First, Color... Rest>
@@ -188,497 +276,3323 @@ constexpr auto makeWColor(bool enabled) {
     return L""sv;
 }
 
-static std::wstring formatDuration(ULONGLONG val) {
-    ULONGLONG parts[4] = {};
-    enum { days, hours, minutes, seconds };
-    const wchar_t suffixes[std::size(parts)] = { L'd', L'h', L'm', L's' };
+// A length of time in milliseconds, possibly infinite.
+//
+// Formats via std::format as "1d 2h 3m 4s" rounded to seconds. Format spec can contain
+// comma separated flags: "ms" to show milliseconds instead of rounding and "compact" to
+// omit spaces. Formatting writes directly to the output and never allocates.
+struct Duration {
+    static constexpr ULONGLONG infinite = std::numeric_limits<ULONGLONG>::max();
 
-    parts[days]     = val / 86'400'000; val %= 86'400'000ull;
-    parts[hours]    = val / 3'600'000;  val %= 3'600'000;
-    parts[minutes]  = val / 60'000;     val %= 60'000;
-    parts[seconds]  = val / 1000;       val %= 1000;
+    ULONGLONG ms;
+};
 
-    parts[seconds] += (val >= 500);
-    if (parts[seconds] == 60)   { ++parts[minutes]; parts[seconds] = 0; }
-    if (parts[minutes] == 60)   { ++parts[hours];   parts[minutes] = 0; }
-    if (parts[hours] == 24)     { ++parts[days];    parts[hours] = 0; }
+template<class CharT>
+struct std::formatter<Duration, CharT> {
+    bool showMillis = false;
+    bool compact = false;
 
-    std::wstring ret;
-    for (size_t i = 0; i < std::size(parts); ++i) {
-        if (parts[i]) {
-            ret += std::to_wstring(parts[i]);
-            ret += suffixes[i];
-            ret += L' ';
+    constexpr auto parse(std::basic_format_parse_context<CharT> & ctx) {
+        auto it = ctx.begin();
+        const auto end = ctx.end();
+        while (it != end && *it != CharT('}')) {
+            auto wordStart = it;
+            while (it != end && *it != CharT('}') && *it != CharT(','))
+                ++it;
+            auto word = std::basic_string_view<CharT>(wordStart, it);
+            if (equals(word, "ms"))
+                showMillis = true;
+            else if (equals(word, "compact"))
+                compact = true;
+            else
+                throw std::format_error("invalid duration format");
+            if (it != end && *it == CharT(','))
+                ++it;
         }
+        return it;
     }
-    if (ret.empty())
-        return L"0s";
-    ret.resize(ret.size() - 1);
-    return ret;
-}
 
-static std::optional<ULONGLONG> parseDuration(std::wstring_view str) {
+    template<class FormatContext>
+    auto format(Duration val, FormatContext & ctx) const {
+        auto out = ctx.out();
+        if (val.ms == Duration::infinite)
+            return writeAscii("Infinite", out);
 
-    auto nstr = narrow(str);
+        constexpr ULONGLONG multiples[] = { 86'400'000, 3'600'000, 60'000, 1'000, 1 };
+        constexpr std::string_view suffixes[std::size(multiples)] = { "d", "h", "m", "s", "ms" };
+        ULONGLONG parts[std::size(multiples)] = {};
+        enum { days, hours, minutes, seconds, millis };
 
-    auto m = ctre::match<
-        R"_(\s*)_"
-        R"_((?:([0-9]+)\s*[dD])?)_"
-        R"_(\s*)_"
-        R"_((?:([0-9]+)\s*[hH])?)_"
-        R"_(\s*)_"
-        R"_((?:([0-9]+)\s*[mM])?)_"
-        R"_(\s*)_"
-        R"_((?:([0-9]+)\s*[sS]?)?)_"
-        R"_(\s*)_">(nstr);
-
-    if (!m)
-        return {};
+        auto rest = val.ms;
+        for (size_t i = 0; i < std::size(multiples); ++i) {
+            parts[i] = rest / multiples[i];
+            rest %= multiples[i];
+        }
+        if (!showMillis) {
+            parts[seconds] += (parts[millis] >= 500);
+            parts[millis] = 0;
+            if (parts[seconds] == 60)   { ++parts[minutes]; parts[seconds] = 0; }
+            if (parts[minutes] == 60)   { ++parts[hours];   parts[minutes] = 0; }
+            if (parts[hours] == 24)     { ++parts[days];    parts[hours] = 0; }
+        }
 
-    
-    auto parsePart = [](std::string_view digits, unsigned multiple, ULONGLONG & acc) {
-        auto first = digits.data();
-        auto last = first + digits.size();
+        bool first = true;
+        for (size_t i = 0; i < std::size(parts); ++i) {
+            if (!parts[i])
+                continue;
+            if (!first && !compact)
+                *out++ = CharT(' ');
+            first = false;
+            out = writeNumber(parts[i], out);
+            out = writeAscii(suffixes[i], out);
+        }
+        if (first)
+            out = writeAscii(showMillis ? "0ms" : "0s", out);
+        return out;
+    }
 
-        ULONGLONG val;
-        auto [ptr, ec] = std::from_chars(first, last, val, 10);
-        if (ec != std::errc() || ptr != last)
-            return false;
-        if ((g_maxDuration - acc) / multiple < val)
-            return false;
-        acc += val * multiple;
-        return true;
-    };
+private:
+    static constexpr bool equals(std::basic_string_view<CharT> str, std::string_view ascii) {
+        return std::ranges::equal(str, ascii, {}, {}, [](char c) { return CharT(c); });
+    }
 
-    ULONGLONG acc = 0;
-    bool has_value = false;
-    if (auto days = m.get<1>()) {
-        if (!parsePart(days.to_view(), 86'400, acc))
-            return std::numeric_limits<ULONGLONG>::max();
-        has_value = true;
+    template<class OutputIt>
+    static OutputIt writeAscii(std::string_view str, OutputIt out) {
+        for (auto c: str)
+            *out++ = CharT(c);
+        return out;
     }
-    if (auto hours = m.get<2>()) {
-        if (!parsePart(hours.to_view(), 3'600, acc))
-            return std::numeric_limits<ULONGLONG>::max();
-        has_value = true;
+
+    template<class OutputIt>
+    static OutputIt writeNumber(ULONGLONG val, OutputIt out) {
+        char buf[std::numeric_limits<ULONGLONG>::digits10 + 1];
+        auto res = std::to_chars(std::begin(buf), std::end(buf), val);
+        return writeAscii(std::string_view(buf, res.ptr), out);
     }
-    if (auto minutes = m.get<3>()) {
-        if (!parsePart(minutes.to_view(), 60, acc))
-            return std::numeric_limits<ULONGLONG>::max();
-        has_value = true;
+};
+//remaining times received from instances are passed around as is
+static_assert(Duration::infinite == g_protocolInfinite);
+
+static Duration remainingUntil(ULONGLONG deadlineTick, ULONGLONG now) {
+    if (deadlineTick == g_infiniteTick)
+        return {Duration::infinite};
+    return {deadlineTick > now ? deadlineTick - now : 0};
+}
+
+// Parses "HH:MM" 24-hour time of day into milliseconds since midnight
+constexpr std::optional<ULONGLONG> parseTimeOfDay(std::wstring_view str) {
+    constexpr auto isDigit = [](wchar_t c) {
+        return c >= L'0' && c <= L'9';
+    };
+    
+    auto colon = str.find(L':');
+    if (colon == str.npos || colon == 0 || colon > 2 || str.size() - colon != 3)
+        return {};
+    unsigned hours = 0, minutes = 0;
+    for (size_t i = 0; i < colon; ++i) {
+        if (!isDigit(str[i]))
+            return {};
+        hours = hours * 10 + unsigned(str[i] - L'0');
     }
-    if (auto seconds = m.get<4>()) {
-        if (!parsePart(seconds.to_view(), 1, acc))
-            return std::numeric_limits<ULONGLONG>::max();
-        has_value = true;
+    for (size_t i = colon + 1; i < str.size(); ++i) {
+        if (!isDigit(str[i]))
+            return {};
+        minutes = minutes * 10 + unsigned(str[i] - L'0');
     }
-
-    if (!has_value)
+    if (hours > 23 || minutes > 59)
         return {};
-
-    acc *= 1000;
-    return acc;
+    return (hours * 60 + minutes) * 60'000ull;
 }
 
-#pragma endregion
+static_assert(parseTimeOfDay(L"7:05") == 25'500'000);
+static_assert(parseTimeOfDay(L"23:59") == 86'340'000);
+static_assert(parseTimeOfDay(L"24:00") == std::nullopt);
+static_assert(parseTimeOfDay(L"12:5") == std::nullopt);
 
-#pragma region Child Process Code
+// Milliseconds from now until the next time the local clock shows the given time of day
+static ULONGLONG durationUntil(ULONGLONG timeOfDay) {
+    SYSTEMTIME now;
+    GetLocalTime(&now);
+    ULONGLONG nowMs = ((now.wHour * 60ull + now.wMinute) * 60 + now.wSecond) * 1000 + now.wMilliseconds;
+    if (timeOfDay > nowMs)
+        return timeOfDay - nowMs;
+    return 86'400'000 - nowMs + timeOfDay;
+}
 
-class WaitTracker {
+// Column layout for tabular output.
+//
+// Cells are kept as raw text in one buffer together with their display width, which is 
+// computed once when the cell is added (plain ASCII skips the full width calculation). 
+// Colors are per column and are only inserted when rendering. Columns are separated by
+// two spaces and shrinkable columns are truncated with '…' if lines would exceed the maximum width.
+class TextTable {
 public:
-    WaitTracker(std::optional<ULONGLONG> duration): 
-        m_duration(duration),
-        m_start(GetTickCount64())
-    {}
+    enum class Align {
+        left,
+        right
+    };
 
-    bool isDone() {
-        return m_duration && (GetTickCount64() - m_start) >= *m_duration;
+    struct Column {
+        std::wstring_view color;    //escape sequence or empty for none
+        Align align = Align::right;
+        unsigned minWidth = 0;
+        bool shrinkable = false;
+    };
+
+    // reset is the escape sequence that ends a colored cell
+    TextTable(std::initializer_list<Column> columns, std::wstring_view reset):
+        m_columns(columns),
+        m_reset(reset) {
+
+        m_widths.reserve(m_columns.size());
+        for (auto & column: m_columns)
+            m_widths.push_back(column.minWidth);
     }
 
-    bool waitNext(HANDLE h) {
-        while (true) {
-            DWORD wait_time = 3'600'000;
-            if (m_duration) {
-                auto elapsed = GetTickCount64() - m_start;
-                if (elapsed >= *m_duration)
-                    return false;
-                wait_time = DWORD(std::min(ULONGLONG(wait_time), *m_duration - elapsed));
-            }
-            auto res = WaitForSingleObject(h, wait_time);
-            if (res == WAIT_TIMEOUT)
-                continue;
-            if (res == WAIT_OBJECT_0)
-                return true;
-            return false;
+    void add(std::initializer_list<std::wstring_view> row) {
+        assert(row.size() == m_columns.size());
+        auto width = m_widths.begin();
+        for (auto text: row) {
+            auto & cell = m_cells.emplace_back(m_text.size(), text.size(), displayWidth(text));
+            m_text += text;
+            *width = std::max(*width, cell.width);
+            ++width;
         }
     }
 
-    std::wstring formatRemaining() const {
-        if (!m_duration)
-            return L"Infinite";
-        auto elapsed = GetTickCount64() - m_start;
-        ULONGLONG remaining = (elapsed <= *m_duration ? *m_duration - elapsed : 0);
-        return formatDuration(remaining);
-    }
-private:
-    std::optional<ULONGLONG> m_duration;
-    ULONGLONG m_start;
-};
+    size_t rowCount() const 
+        { return m_cells.size() / m_columns.size(); }
 
+    // Appends all rows to out, each terminated by a newline
+    void render(std::wstring & out, unsigned maxWidth = std::numeric_limits<unsigned>::max()) const {
+        auto widths = fitWidths(maxWidth);
+        size_t lineSize = widths.size() * 2;
+        for (size_t i = 0; i < widths.size(); ++i)
+            lineSize += widths[i] + m_columns[i].color.size() + m_reset.size();
+        out.reserve(out.size() + rowCount() * lineSize);
 
-// By default pipes get a security descriptor that grants read access to 
-// members of the Everyone group and the anonymous account. Ugh
-// Let's create one that doesn't
-static unqiue_local_membuf<SECURITY_DESCRIPTOR> createPipeSecurityDescriptor() {
-    HANDLE token = GetCurrentProcessToken();
+        for (size_t row = 0; row < rowCount(); ++row) {
+            renderRow(out, row, widths);
+            out += L'\n';
+        }
+    }
 
-    std::vector<BYTE> buf;
-    getTokenInfo(token, TokenUser, buf);
-    auto pusr = (TOKEN_USER *)buf.data();
-    unqiue_local_membuf<wchar_t> stringUserSid;
-    if (!ConvertSidToStringSidW(pusr->User.Sid, std::out_ptr(stringUserSid)))
-        throwLastError("ConvertSidToStringSid");
+    // Renders every row as a separate line without terminator
+    std::vector<std::wstring> renderLines(unsigned maxWidth = std::numeric_limits<unsigned>::max()) const {
+        auto widths = fitWidths(maxWidth);
+        std::vector<std::wstring> ret(rowCount());
+        for (size_t row = 0; row < ret.size(); ++row)
+            renderRow(ret[row], row, widths);
+        return ret;
+    }
 
-    getTokenInfo(token, TokenPrimaryGroup, buf);
-    auto * pgrp = (TOKEN_PRIMARY_GROUP *)buf.data();
-    unqiue_local_membuf<wchar_t> stringGroupSid;
-    if (!ConvertSidToStringSidW(pgrp->PrimaryGroup, std::out_ptr(stringGroupSid)))
-        throwLastError("ConvertSidToStringSid");
+private:
+    struct Cell {
+        size_t offset;
+        size_t length;
+        unsigned width;
+    };
 
-    auto sddl = std::format(L"O:{0}G:{1}D:(A;;FA;;;SY)(A;;FA;;;BA)(A;;FA;;;{0})", stringUserSid.get(), stringGroupSid.get());
+    static unsigned displayWidth(std::wstring_view text) {
+        if (std::ranges::all_of(text, [](wchar_t c) { return c >= L' ' && c < 0x7F; }))
+            return unsigned(text.size());
+        return unsigned(stringWidth(text));
+    }
 
-    unqiue_local_membuf<SECURITY_DESCRIPTOR> desc;
-    ULONG descSize;
-    if (!ConvertStringSecurityDescriptorToSecurityDescriptor(sddl.c_str(), SDDL_REVISION_1, std::out_ptr(desc), &descSize))
-        throwLastError("ConvertStringSecurityDescriptorToSecurityDescriptor");
+    // Longest prefix of text no wider than maxWidth. Surrogate pairs are never split.
+    static std::wstring_view truncateToWidth(std::wstring_view text, unsigned maxWidth, unsigned & width) {
+        size_t pos = 0;
+        width = 0;
+        while (pos < text.size()) {
+            size_t len = IS_HIGH_SURROGATE(text[pos]) && pos + 1 < text.size() && IS_LOW_SURROGATE(text[pos + 1]) ? 2 : 1;
+            auto charWidth = displayWidth(text.substr(pos, len));
+            if (width + charWidth > maxWidth)
+                break;
+            width += charWidth;
+            pos += len;
+        }
+        return text.substr(0, pos);
+    }
 
-    return desc;
-}
+    std::vector<unsigned> fitWidths(unsigned maxWidth) const {
+        constexpr unsigned minShrunkWidth = 4;
 
-static std::optional<std::string> readPipeMessage(HANDLE hPipe, size_t expectedSize) {
-    std::string ret;
-    ret.resize(expectedSize);
-    size_t consumed = 0;
-    for ( ; ; ) {
-        DWORD read = 0;
-        if (ReadFile(hPipe, ret.data() + consumed, DWORD(ret.size() - consumed), &read, nullptr)) {
-            consumed += read;
-            ret.resize(consumed);
-            return {std::move(ret)};
+        auto widths = m_widths;
+        unsigned total = unsigned(widths.size() - 1) * 2;
+        for (auto width: widths)
+            total += width;
+        for (size_t i = 0; i < widths.size() && total > maxWidth; ++i) {
+            if (!m_columns[i].shrinkable || widths[i] <= minShrunkWidth)
+                continue;
+            auto shrinkBy = std::min(widths[i] - minShrunkWidth, total - maxWidth);
+            widths[i] -= shrinkBy;
+            total -= shrinkBy;
         }
-        auto err = GetLastError();
-        if (err == ERROR_MORE_DATA) {
-            consumed += read;
-            ret.resize(consumed + 16);
-            continue;
+        return widths;
+    }
+
+    void renderRow(std::wstring & out, size_t row, const std::vector<unsigned> & widths) const {
+        for (size_t i = 0; i < m_columns.size(); ++i) {
+            auto & column = m_columns[i];
+            auto & cell = m_cells[row * m_columns.size() + i];
+            auto text = std::wstring_view(m_text).substr(cell.offset, cell.length);
+            auto width = cell.width;
+            bool truncated = width > widths[i];
+            if (truncated) {
+                text = truncateToWidth(text, widths[i] - 1, width);
+                ++width; //the ellipsis
+            }
+            auto padding = widths[i] - width;
+            
+            if (column.align == Align::right)
+                out.append(padding, L' ');
+            out += column.color;
+            out += text;
+            if (truncated)
+                out += L'…';
+            if (!column.color.empty())
+                out += m_reset;
+            if (i != m_columns.size() - 1) {
+                if (column.align == Align::left)
+                    out.append(padding, L' ');
+                out += L"  ";
+            }
         }
-        return {};
     }
-}
 
-static bool writePipeMessage(HANDLE hPipe, std::string_view data) {
-    DWORD written;
-    if (!WriteFile(hPipe, data.data(), DWORD(data.size()), &written, nullptr))
-        return false;
-    assert(written == DWORD(data.size())); //this cannot fail for message-oriented pipes
-    return true;
-}
+private:
+    std::vector<Column> m_columns;
+    std::wstring_view m_reset;
+    std::vector<unsigned> m_widths;
+    std::vector<Cell> m_cells;
+    std::wstring m_text;
+};
+
+#pragma endregion
+
+#pragma region Child Process Code
 
-static void writeInfo(HANDLE hPipe, const WaitTracker & tracker) {
-    std::string reply = narrow(tracker.formatRemaining());
-    writePipeMessage(hPipe, reply);
-    FlushFileBuffers(hPipe);
+// Clock against which WaitTracker measures its duration
+enum class WaitClock {
+    monotonic,  //does not advance while the machine sleeps
+    boot,       //time since boot, including sleep
+    wall        //system time, follows clock adjustments
+};
+
+static std::optional<WaitClock> parseWaitClock(std::wstring_view str) {
+    if (str == L"monotonic") return WaitClock::monotonic;
+    if (str == L"boot")      return WaitClock::boot;
+    if (str == L"wall")      return WaitClock::wall;
+    return std::nullopt;
 }
 
-static void runDirect(std::optional<ULONGLONG> duration, ColorStatus envColorStatus) {
+// Settings the launcher passes to the background instance it spawns.
+//
+// They travel hex-encoded in our environment variable so the instance can start without 
+// parsing the command line again. The duration is counted from issuedTick rather than from 
+// when the instance gets to run.
+struct ChildSettings {
+    static constexpr DWORD currentVersion = 2;
 
-    auto desc = createPipeSecurityDescriptor();
+    enum Flags : DWORD {
+        hasDuration    = 0x0001,
+        wallClock      = 0x0002,
+        shared         = 0x0004,
+        monotonicClock = 0x0008
+    };
 
-    SECURITY_ATTRIBUTES sa;
-    sa.nLength = sizeof(sa);
-    sa.lpSecurityDescriptor = desc.get();
-    sa.bInheritHandle = false;
+    DWORD version;
+    DWORD flags;
+    ULONGLONG durationMs;
+    ULONGLONG issuedTick;   //GetTickCount64() when the duration was determined
+    ULONGLONG reportPipe;   //inherited handle to send LaunchReport through
 
-    AutoFile hPipe =  CreateNamedPipe(makePipeName(GetCurrentProcessId()).c_str(),
-                                      PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE | FILE_FLAG_OVERLAPPED, 
-                                      PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
-                                      1, 4096, 0, 
-                                      NMPWAIT_USE_DEFAULT_WAIT, &sa);
-    if (!hPipe)
-        throwLastError("CreateNamedPipe");
+    static ChildSettings make(std::optional<ULONGLONG> duration, WaitClock clock, bool isBroker) {
+        ChildSettings ret{currentVersion, 0, duration.value_or(0), GetTickCount64(), 0};
+        if (duration)
+            ret.flags |= hasDuration;
+        if (clock == WaitClock::wall)
+            ret.flags |= wallClock;
+        else if (clock == WaitClock::monotonic)
+            ret.flags |= monotonicClock;
+        if (isBroker)
+            ret.flags |= shared;
+        return ret;
+    }
 
-    AutoHandle hEvent = CreateEvent(nullptr, true, true, nullptr);
-    if (!hEvent)
-        throwLastError("CreateEvent");
+    std::optional<ULONGLONG> duration() const {
+        if (!(flags & hasDuration))
+            return std::nullopt;
+        return durationMs;
+    }
 
-        
-    auto oldState = SetThreadExecutionState(ES_CONTINUOUS | ES_SYSTEM_REQUIRED);
-    if (oldState == 0)
-        throwLastError("SetThreadExecutionState");
+    // Duration still left of the one originally requested
+    std::optional<ULONGLONG> remaining() const {
+        if (!(flags & hasDuration))
+            return std::nullopt;
+        auto now = GetTickCount64();
+        auto elapsed = now - std::min(now, issuedTick);
+        return durationMs - std::min(durationMs, elapsed);
+    }
 
-    auto useColor = shouldUseColor(envColorStatus, stdout);
+    WaitClock clock() const { 
+        if (flags & wallClock)
+            return WaitClock::wall;
+        return (flags & monotonicClock) ? WaitClock::monotonic : WaitClock::boot;
+    }
+    bool isShared() const
+        { return (flags & shared) != 0; }
 
-    if (duration) 
-        wprint(stdout, L"{0}preventing sleep for{1} {2}{4}{1} {0}or until process{1} {3}{5}{1} {0}is stopped{1}\n",
-            makeWColor<KA_COLOR_SUCCESS>(useColor),
-            makeWColor<Color::normal>(useColor),
-            makeWColor<KA_COLOR_DURATION>(useColor),
-            makeWColor<KA_COLOR_PID>(useColor),
-            formatDuration(*duration), 
-            GetCurrentProcessId());
-    else
-        wprint(stdout, L"{0}preventing sleep indefinitely or until process{1} {2}{3}{1} {0}is stopped{1}\n",
-            makeWColor<KA_COLOR_SUCCESS>(useColor),
-            makeWColor<Color::normal>(useColor),
-            makeWColor<KA_COLOR_PID>(useColor),
-            GetCurrentProcessId());
-    
-    //Disconnect from parent, exceptions will not be reported from this point on
-    (void)freopen("NUL:", "w", stdout);
-    (void)freopen("NUL:", "w", stderr);
-        
-    WaitTracker tracker(duration);
-        
-    while(!tracker.isDone()) {
-
-        OVERLAPPED ovl{};
-        ovl.hEvent = hEvent.get();
-
-        // The code below can work with or without pipe
-        // For now we fail above if the pipe cannot be created.
-        // However, it is possible to make that non-fatal and this
-        // code will work just fine.
-        SetLastError(ERROR_IO_PENDING);
-        if (!hPipe || !ConnectNamedPipe(hPipe.get(), &ovl)) {
-            DWORD err = GetLastError();
-            if (err == ERROR_IO_PENDING) {
-                if (!tracker.waitNext(hEvent.get()))
-                    break;
-                DWORD dummy;
-                GetOverlappedResult(hPipe.get(), &ovl, &dummy, false);
-            } else if (err != ERROR_PIPE_CONNECTED) {
-                DisconnectNamedPipe(hPipe.get());
-                continue;
-            }
-        }
-        assert(hPipe);
-                
-        auto command = readPipeMessage(hPipe.get(), 4);
-        if (command) {
-            if (*command == "info") {
-                writeInfo(hPipe.get(), tracker);
-            } else if (*command == "stop") {
-                break;
-            }
+    std::wstring encode() const {
+        std::wstring ret;
+        ret.reserve(2 * sizeof(*this));
+        for (auto byte: std::span(reinterpret_cast<const BYTE *>(this), sizeof(*this)))
+            std::format_to(std::back_inserter(ret), L"{:02X}", byte);
+        return ret;
+    }
+
+    static std::optional<ChildSettings> decode(std::wstring_view str) {
+        if (str.size() != 2 * sizeof(ChildSettings))
+            return std::nullopt;
+        auto nibble = [](wchar_t c) -> int {
+            if (c >= L'0' && c <= L'9') return c - L'0';
+            if (c >= L'A' && c <= L'F') return c - L'A' + 10;
+            return -1;
+        };
+        ChildSettings ret{};
+        auto bytes = reinterpret_cast<BYTE *>(&ret);
+        for (size_t i = 0; i < sizeof(ret); ++i) {
+            auto high = nibble(str[2 * i]), low = nibble(str[2 * i + 1]);
+            if (high < 0 || low < 0)
+                return std::nullopt;
+            bytes[i] = BYTE((high << 4) | low);
         }
-        DisconnectNamedPipe(hPipe.get());
+        if (ret.version != currentVersion)
+            return std::nullopt;
+        return ret;
     }
-    
-    SetThreadExecutionState(ES_CONTINUOUS);
-        
-}
+};
+static_assert(sizeof(ChildSettings) == 32);
 
-#pragma endregion
+// Record the background instance sends to its launcher once it is running or has failed to start.
+// The launcher renders it and exits right away with a matching exit code.
+struct LaunchReport {
+    enum Type : DWORD {
+        started = 1,    //running as a standalone instance
+        leased  = 2,    //holding a lease in a broker, not necessarily this process
+        failed  = 3
+    };
 
-#pragma region Main Code
+    DWORD type;
+    DWORD pid;
+    DWORD leaseId;
+    DWORD reserved;
+    ULONGLONG deadline;     //UTC FILETIME of expiration or g_protocolInfinite
+    char message[488];      //UTF-8 description of a failure, NUL terminated
+};
+static_assert(sizeof(LaunchReport) == 512);
 
-static void runChild(ColorStatus envColorStatus) {
-    if (!SetEnvironmentVariable(g_myGuid, L"ON"))
-        throwLastError("SetEnvironmentVariable");
+// Sends LaunchReport to the launcher exactly once
+class LaunchReporter {
+public:
+    explicit LaunchReporter(HANDLE pipe) noexcept:
+        m_pipe(pipe)
+    {}
 
-    if (shouldUseColor(envColorStatus, stdout) && shouldUseColor(envColorStatus, stderr)) {
-        if (!SetEnvironmentVariable(L"FORCE_COLOR", L"1"))
-            throwLastError("SetEnvironmentVariable");
-    }
+    void started(std::optional<ULONGLONG> duration) noexcept 
+        { send(LaunchReport::started, GetCurrentProcessId(), 0, duration); }
 
-    std::wstring exe = myname();
-    
-    SECURITY_ATTRIBUTES pipeAttr;
-    pipeAttr.nLength = sizeof(pipeAttr); 
-    pipeAttr.bInheritHandle = true; 
-    pipeAttr.lpSecurityDescriptor = nullptr; 
+    void leased(DWORD brokerPid, DWORD leaseId, std::optional<ULONGLONG> duration) noexcept
+        { send(LaunchReport::leased, brokerPid, leaseId, duration); }
 
-    AutoFile hRead, hWrite;
-    if (!CreatePipe(&hRead.out(), &hWrite.out(), &pipeAttr, 0))
-        throwLastError("CreatePipe");
-    if (!SetHandleInformation(hRead.get(), HANDLE_FLAG_INHERIT, 0))
-        throwLastError("SetHandleInformation(read pipe)");
-    AutoFile hErrWrite;
-    if (!DuplicateHandle(GetCurrentProcess(), hWrite.get(), GetCurrentProcess(), &hErrWrite.out(), 0, true, DUPLICATE_SAME_ACCESS))
-        throwLastError("DuplicateHandle(write pipe)");
+    // Does nothing if success has already been reported
+    void failed(const std::exception & ex) noexcept {
+        if (!m_pipe)
+            return;
+        LaunchReport report{};
+        report.type = LaunchReport::failed;
+        report.pid = GetCurrentProcessId();
+        report.deadline = g_protocolInfinite;
+        strncpy_s(report.message, ex.what(), _TRUNCATE);
+        write(report);
+    }
 
-    for(DWORD id: {STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE}) {
-        auto h = GetStdHandle(id);
-        if (h == nullptr || h == INVALID_HANDLE_VALUE)
-            continue;
-        if (!SetHandleInformation(h, HANDLE_FLAG_INHERIT, 0))
-            throwLastError("SetHandleInformation(std handle)");
+private:
+    void send(LaunchReport::Type type, DWORD pid, DWORD leaseId, std::optional<ULONGLONG> duration) noexcept {
+        LaunchReport report{};
+        report.type = type;
+        report.pid = pid;
+        report.leaseId = leaseId;
+        report.deadline = g_protocolInfinite;
+        if (duration) {
+            FILETIME ft;
+            GetSystemTimeAsFileTime(&ft);
+            report.deadline = fileTimeToUInt64(ft) + *duration * 10'000;
+        }
+        write(report);
     }
-    
-    STARTUPINFOW si{};
-    si.cb = sizeof(si);
-    si.dwFlags = STARTF_USESTDHANDLES;
-    si.hStdInput = INVALID_HANDLE_VALUE;
-    si.hStdOutput = hWrite.get();
-    si.hStdError = hErrWrite.get();
-    PROCESS_INFORMATION pi;
 
-    std::wstring cmdline = GetCommandLine();
+    void write(const LaunchReport & report) noexcept {
+        DWORD written;
+        WriteFile(m_pipe.get(), &report, sizeof(report), &written, nullptr);
+        m_pipe.reset();
+    }
 
-    if (!CreateProcess(exe.data(), cmdline.data(), nullptr, nullptr, true, CREATE_DEFAULT_ERROR_MODE | CREATE_NO_WINDOW | DETACHED_PROCESS, nullptr, nullptr, &si, &pi))
-        throwLastError("CreateProcess");
-    CloseHandle(pi.hProcess);
-    CloseHandle(pi.hThread);
+private:
+    AutoFile m_pipe;
+};
 
-    hWrite.reset();
-    hErrWrite.reset();
-    while (true) {
-        char buf[4096];
-        DWORD read;
-        if (!ReadFile(hRead.get(), buf, sizeof(buf), &read, nullptr))
-            break;
-        fwrite(buf, 1, read, stdout);
-    }
-}
-
-static DWORD execOnPipe(DWORD procId, std::string_view cmd, std::invocable<HANDLE> auto && proc) 
-    requires(std::is_same_v<decltype(std::forward<decltype(proc)>(proc)(HANDLE{})), DWORD> ||
-             std::is_same_v<decltype(std::forward<decltype(proc)>(proc)(HANDLE{})), void>)
-{
-    std::wstring pipeName = makePipeName(procId);
-    while(true) {
-        AutoFile hPipe = CreateFile(pipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
-        if (!hPipe) {
-            DWORD err = GetLastError();
-            if (err == ERROR_PIPE_BUSY) {
-                if (!WaitNamedPipe(pipeName.c_str(), NMPWAIT_WAIT_FOREVER))
-                    return GetLastError();
-                continue;
-            }
-            return err;
+// Tracks expiration of an optional duration using a waitable timer.
+//
+// The timer is armed for the expected expiration so the owner wakes up once, when it is due,
+// rather than periodically. The timer is only a wakeup: expiration is always decided by the
+// chosen clock and if the timer fires early relative to it, it is simply re-armed.
+class WaitTracker {
+public:
+    // tolerance is how late, in ms, the expiration may be signaled to let the OS coalesce wakeups
+    WaitTracker(std::optional<ULONGLONG> duration, WaitClock clock = WaitClock::boot, ULONGLONG tolerance = 0): 
+        m_duration(duration),
+        m_clock(clock),
+        m_tolerance(tolerance),
+        m_start(GetTickCount64()),
+        m_clockStart(clockNow(clock)) {
+
+        if (m_duration) {
+            createTimer();
+            arm();
         }
-        DWORD mode = PIPE_READMODE_MESSAGE;
-        if (!SetNamedPipeHandleState(hPipe.get(), &mode, nullptr, nullptr))
-            return GetLastError();
-        if (!writePipeMessage(hPipe.get(), cmd))
-            return GetLastError();
-        if constexpr (std::is_same_v<decltype(std::forward<decltype(proc)>(proc)(hPipe.get())), DWORD>)
-            return std::forward<decltype(proc)>(proc)(hPipe.get());
-        else {
-            std::forward<decltype(proc)>(proc)(hPipe.get());
-            return ERROR_SUCCESS;
+    }
+    WaitTracker(const WaitTracker &) = delete;
+    WaitTracker & operator=(const WaitTracker &) = delete;
+
+    // Signaled when the duration might have expired, at which point call isDone().
+    // nullptr if there is no duration.
+    HANDLE timer() const 
+        { return m_timer.get(); }
+
+    bool isDone() {
+        if (!m_duration)
+            return false;
+        if (elapsed() >= *m_duration)
+            return true;
+        if (WaitForSingleObject(m_timer.get(), 0) == WAIT_OBJECT_0)
+            arm();
+        return false;
+    }
+
+    Duration remaining() const {
+        if (!m_duration)
+            return {Duration::infinite};
+        auto done = elapsed();
+        return {*m_duration > done ? *m_duration - done : 0};
+    }
+
+    // Makes ms the time remaining from now on and re-arms the timer right away
+    void setRemaining(ULONGLONG ms) {
+        if (!m_timer)
+            createTimer();
+        auto done = elapsed();
+        m_duration = done + std::min(ms, std::numeric_limits<ULONGLONG>::max() - done);
+        arm();
+    }
+
+    std::optional<ULONGLONG> duration() const 
+        { return m_duration; }
+    ULONGLONG startTick() const 
+        { return m_start; }
+    ULONGLONG deadlineTick() const { 
+        if (!m_duration)
+            return g_infiniteTick;
+        if (m_clock == WaitClock::boot)
+            return m_start + *m_duration;
+        return GetTickCount64() + remaining().ms;
+    }
+private:
+    // Current time of a clock in 100ns units
+    static ULONGLONG clockNow(WaitClock clock) noexcept {
+        switch(clock) {
+            case WaitClock::monotonic: {
+                ULONGLONG ret;
+                QueryUnbiasedInterruptTime(&ret);
+                return ret;
+            }
+            case WaitClock::wall: {
+                FILETIME ft;
+                GetSystemTimeAsFileTime(&ft);
+                return fileTimeToUInt64(ft);
+            }
+            default:
+                return GetTickCount64() * 10'000;
+        }
+    }
+
+    void createTimer() {
+        m_timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_MANUAL_RESET, TIMER_ALL_ACCESS);
+        if (!m_timer)
+            throwLastError("CreateWaitableTimerEx");
+    }
+
+    // Milliseconds elapsed on our clock. Clocks that go backwards count as not advancing.
+    ULONGLONG elapsed() const noexcept {
+        auto now = clockNow(m_clock);
+        return now > m_clockStart ? (now - m_clockStart) / 10'000 : 0;
+    }
+
+    void arm() {
+        LARGE_INTEGER due;
+        if (m_clock == WaitClock::wall) {
+            //absolute due time tracks system clock changes
+            due.QuadPart = LONGLONG(std::min(m_clockStart + *m_duration * 10'000, ULONGLONG(std::numeric_limits<LONGLONG>::max())));
+        } else {
+            auto left = remaining().ms;
+            due.QuadPart = -LONGLONG(std::min(left, ULONGLONG(std::numeric_limits<LONGLONG>::max() / 10'000)) * 10'000);
+        }
+        if (!SetWaitableTimerEx(m_timer.get(), &due, 0, nullptr, nullptr, nullptr, ULONG(std::min(m_tolerance, ULONGLONG(MAXLONG)))))
+            throwLastError("SetWaitableTimerEx");
+    }
+
+private:
+    std::optional<ULONGLONG> m_duration;
+    WaitClock m_clock;
+    ULONGLONG m_tolerance;
+    ULONGLONG m_start;
+    ULONGLONG m_clockStart;
+    AutoHandle m_timer;
+};
+
+// Conditions that keep an instance running, in addition to its duration, for as long as any of them holds:
+// a process is alive, a process tree is alive or a file is locked by someone.
+//
+// Every condition is a kernel object that we wait for together with everything else, so waiting uses 
+// no CPU and the instance stops as soon as the last condition ends. The launcher opens the objects, so that 
+// errors are reported to the user and process IDs cannot be reused meanwhile. The background instance 
+// inherits them and gets the handle values via conditionsEnvVarName() variable.
+enum class WaitConditionKind : wchar_t {
+    process = L'p',     //process handle, signaled on exit
+    tree    = L't',     //job object containing the process tree
+    lock    = L'l'      //overlapped file handle to wait for an exclusive lock on
+};
+
+struct WaitCondition {
+    WaitConditionKind kind;
+    AutoHandle object;
+};
+
+// The main loop waits for the control pipe, the expiration timer and all conditions at once
+constexpr size_t g_maxWaitConditions = MAXIMUM_WAIT_OBJECTS - 2;
+
+// Environment variable that passes wait conditions to the background instance
+static std::wstring conditionsEnvVarName() {
+    return std::format(L"{}-WHILE", g_myGuid);
+}
+
+static std::wstring encodeConditions(std::span<const WaitCondition> conditions) {
+    std::wstring ret;
+    for (auto & condition: conditions)
+        std::format_to(std::back_inserter(ret), L"{}{} ", wchar_t(condition.kind), uintptr_t(condition.object.get()));
+    return ret;
+}
+
+static WaitCondition openProcessCondition(DWORD pid) {
+    AutoHandle process = OpenProcess(SYNCHRONIZE, true, pid);
+    if (!process) {
+        auto err = GetLastError();
+        if (err == ERROR_INVALID_PARAMETER)
+            throw std::runtime_error(std::format("process {} is not running", pid));
+        throwWin32Error(err, "OpenProcess");
+    }
+    if (WaitForSingleObject(process.get(), 0) == WAIT_OBJECT_0)
+        throw std::runtime_error(std::format("process {} is not running", pid));
+    return {WaitConditionKind::process, std::move(process)};
+}
+
+// Puts the process and all its descendants into a new job. Processes they start later join 
+// the job automatically, so the job becomes empty once the whole tree has exited.
+static WaitCondition openTreeCondition(DWORD rootPid) {
+    SECURITY_ATTRIBUTES attr{sizeof(attr), nullptr, true};
+    AutoHandle job = CreateJobObjectW(&attr, nullptr);
+    if (!job)
+        throwLastError("CreateJobObject");
+    //The job must not change how the tracked processes behave. Processes they start with
+    //CREATE_BREAKAWAY_FROM_JOB leave it as they would otherwise and are not tracked.
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits{};
+    limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_BREAKAWAY_OK;
+    if (!SetInformationJobObject(job.get(), JobObjectExtendedLimitInformation, &limits, sizeof(limits)))
+        throwLastError("SetInformationJobObject");
+
+    //creation time of every process in the job by pid
+    std::map<DWORD, ULONGLONG> members;
+    auto assign = [&](DWORD pid, ULONGLONG notBefore) -> DWORD {
+        AutoHandle process = OpenProcess(PROCESS_SET_QUOTA | PROCESS_TERMINATE | PROCESS_QUERY_LIMITED_INFORMATION | SYNCHRONIZE, 
+                                         false, pid);
+        if (!process)
+            return GetLastError();
+        FILETIME creation, exitTime, kernelTime, userTime;
+        if (!GetProcessTimes(process.get(), &creation, &exitTime, &kernelTime, &userTime))
+            return GetLastError();
+        //a process older than its supposed parent has a reused parent pid and is not a descendant
+        if (fileTimeToUInt64(creation) < notBefore || WaitForSingleObject(process.get(), 0) == WAIT_OBJECT_0)
+            return ERROR_INVALID_PARAMETER;
+        if (!AssignProcessToJobObject(job.get(), process.get()))
+            return GetLastError();
+        members[pid] = fileTimeToUInt64(creation);
+        return ERROR_SUCCESS;
+    };
+
+    if (auto err = assign(rootPid, 0); err != ERROR_SUCCESS) {
+        if (err == ERROR_INVALID_PARAMETER)
+            throw std::runtime_error(std::format("process {} is not running", rootPid));
+        throwWin32Error(err, "AssignProcessToJobObject");
+    }
+
+    //Existing descendants have to be added explicitly. Repeat until no new ones appear to also catch 
+    //those started by descendants that were not in the job yet.
+    auto mypid = GetCurrentProcessId();
+    for (bool added = true; added; ) {
+        added = false;
+        AutoFile snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+        if (!snapshot)
+            throwLastError("CreateToolhelp32Snapshot");
+        PROCESSENTRY32W entry{};
+        entry.dwSize = sizeof(entry);
+        for (bool ok = Process32FirstW(snapshot.get(), &entry) != FALSE; ok; ok = Process32NextW(snapshot.get(), &entry) != FALSE) {
+            //We are most likely a descendant ourselves (e.g. of the shell we were started from). In the job
+            //we would pass it on to the background instance which would then keep the job from ever emptying.
+            if (entry.th32ProcessID == mypid || members.contains(entry.th32ProcessID))
+                continue;
+            auto parent = members.find(entry.th32ParentProcessID);
+            //descendants that have exited or cannot be opened are not tracked
+            if (parent != members.end() && assign(entry.th32ProcessID, parent->second) == ERROR_SUCCESS)
+                added = true;
+        }
+    }
+    return {WaitConditionKind::tree, std::move(job)};
+}
+
+static WaitCondition openLockCondition(const std::wstring & path) {
+    SECURITY_ATTRIBUTES attr{sizeof(attr), nullptr, true};
+    AutoFile file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, &attr, 
+                                OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+    if (!file)
+        throwLastError("CreateFile");
+
+    //Waiting for a lock nobody holds would end immediately which is most likely not what the user wants
+    AutoHandle event = CreateEvent(nullptr, true, false, nullptr);
+    if (!event)
+        throwLastError("CreateEvent");
+    OVERLAPPED overlapped{};
+    overlapped.hEvent = event.get();
+    if (LockFileEx(file.get(), LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, MAXDWORD, MAXDWORD, &overlapped)) {
+        UnlockFileEx(file.get(), 0, MAXDWORD, MAXDWORD, &overlapped);
+        throw std::runtime_error(std::format("{} is not locked", narrow(path)));
+    }
+    if (auto err = GetLastError(); err != ERROR_LOCK_VIOLATION)
+        throwWin32Error(err, "LockFileEx");
+
+    return {WaitConditionKind::lock, AutoHandle(std::exchange(file.out(), INVALID_HANDLE_VALUE))};
+}
+
+// Background instance side of wait conditions.
+//
+// Process handles are waited for directly. Emptiness of a job is only reported through a completion 
+// port, so a thread sleeps on the port and signals an event for each job that became empty. Locks are 
+// requested via overlapped LockFileEx whose event is signaled once we get the lock, i.e. the previous 
+// holder released it. We release it right away.
+class ConditionWaiter {
+public:
+    // encoded is the value of conditionsEnvVarName() variable, empty if there are no conditions
+    explicit ConditionWaiter(std::wstring_view encoded) {
+        try {
+            while (!encoded.empty()) {
+                auto end = std::min(encoded.find(L' '), encoded.size());
+                auto token = encoded.substr(0, end);
+                encoded.remove_prefix(std::min(end + 1, encoded.size()));
+                if (token.size() < 2)
+                    throw std::runtime_error("invalid wait conditions");
+                uintptr_t value = 0;
+                for (auto c: token.substr(1)) {
+                    if (c < L'0' || c > L'9')
+                        throw std::runtime_error("invalid wait conditions");
+                    value = value * 10 + uintptr_t(c - L'0');
+                }
+                add(WaitConditionKind(token[0]), HANDLE(value));
+            }
+            if (m_port) {
+                m_watcher = std::jthread([this]() {
+                    for ( ; ; ) {
+                        DWORD message;
+                        ULONG_PTR key;
+                        LPOVERLAPPED overlapped;
+                        if (!GetQueuedCompletionStatus(m_port.get(), &message, &key, &overlapped, INFINITE) || key == 0)
+                            break;
+                        if (message == JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO)
+                            SetEvent(reinterpret_cast<Condition *>(key)->event.get());
+                    }
+                });
+            }
+        } catch (...) {
+            cancelLocks();
+            throw;
+        }
+    }
+    ~ConditionWaiter() noexcept {
+        if (m_watcher.joinable())
+            PostQueuedCompletionStatus(m_port.get(), 0, 0, nullptr);
+        cancelLocks();
+    }
+    ConditionWaiter(const ConditionWaiter &) = delete;
+    ConditionWaiter & operator=(const ConditionWaiter &) = delete;
+
+    // Handles that become signaled when a condition ends, call signaled() when one does
+    std::span<const HANDLE> handles() const 
+        { return m_handles; }
+
+    void signaled(size_t idx) {
+        auto condition = m_pending[idx];
+        if (condition->kind == WaitConditionKind::lock)
+            UnlockFileEx(condition->object.get(), 0, MAXDWORD, MAXDWORD, &condition->overlapped);
+        m_handles.erase(m_handles.begin() + idx);
+        m_pending.erase(m_pending.begin() + idx);
+    }
+
+    // True if there were conditions and none of them holds anymore
+    bool isDone() const 
+        { return !m_conditions.empty() && m_pending.empty(); }
+
+private:
+    struct Condition {
+        WaitConditionKind kind = WaitConditionKind::process;
+        AutoHandle object;
+        AutoHandle event;
+        OVERLAPPED overlapped{};
+        bool lockRequested = false;
+    };
+
+    // Lock requests have to complete before their OVERLAPPEDs go away
+    void cancelLocks() noexcept {
+        for (auto & condition: m_conditions) {
+            if (condition.lockRequested && WaitForSingleObject(condition.event.get(), 0) != WAIT_OBJECT_0) {
+                DWORD transferred;
+                CancelIoEx(condition.object.get(), &condition.overlapped);
+                GetOverlappedResult(condition.object.get(), &condition.overlapped, &transferred, true);
+            }
+        }
+    }
+
+    void add(WaitConditionKind kind, HANDLE object) {
+        if (m_conditions.size() == g_maxWaitConditions)
+            throw std::runtime_error("too many wait conditions");
+        auto & condition = m_conditions.emplace_back();
+        condition.kind = kind;
+        condition.object = AutoHandle(object);
+        switch(kind) {
+            case WaitConditionKind::process:
+                m_handles.push_back(condition.object.get());
+                break;
+            case WaitConditionKind::tree: {
+                condition.event = CreateEvent(nullptr, true, false, nullptr);
+                if (!condition.event)
+                    throwLastError("CreateEvent");
+                if (!m_port) {
+                    m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+                    if (!m_port)
+                        throwLastError("CreateIoCompletionPort");
+                }
+                JOBOBJECT_ASSOCIATE_COMPLETION_PORT association{&condition, m_port.get()};
+                if (!SetInformationJobObject(condition.object.get(), JobObjectAssociateCompletionPortInformation, &association, sizeof(association)))
+                    throwLastError("SetInformationJobObject");
+                //the tree might have exited before we started listening
+                JOBOBJECT_BASIC_ACCOUNTING_INFORMATION accounting;
+                if (!QueryInformationJobObject(condition.object.get(), JobObjectBasicAccountingInformation, &accounting, sizeof(accounting), nullptr))
+                    throwLastError("QueryInformationJobObject");
+                if (accounting.ActiveProcesses == 0)
+                    SetEvent(condition.event.get());
+                m_handles.push_back(condition.event.get());
+                break;
+            }
+            case WaitConditionKind::lock: {
+                condition.event = CreateEvent(nullptr, true, false, nullptr);
+                if (!condition.event)
+                    throwLastError("CreateEvent");
+                condition.overlapped.hEvent = condition.event.get();
+                if (!LockFileEx(condition.object.get(), LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &condition.overlapped)) {
+                    if (auto err = GetLastError(); err != ERROR_IO_PENDING)
+                        throwWin32Error(err, "LockFileEx");
+                }
+                condition.lockRequested = true;
+                m_handles.push_back(condition.event.get());
+                break;
+            }
+            default:
+                throw std::runtime_error("invalid wait conditions");
+        }
+        m_pending.push_back(&condition);
+    }
+
+private:
+    std::list<Condition> m_conditions;
+    std::vector<HANDLE> m_handles;
+    std::vector<Condition *> m_pending;    //parallel to m_handles
+    AutoHandle m_port;
+    std::jthread m_watcher;
+};
+
+
+// By default pipes get a security descriptor that grants read access to 
+// members of the Everyone group and the anonymous account. Ugh
+// Let's create one that doesn't
+static unqiue_local_membuf<SECURITY_DESCRIPTOR> createPipeSecurityDescriptor() {
+    TraceSpan span("createPipeSecurityDescriptor");
+    HANDLE token = GetCurrentProcessToken();
+
+    std::vector<BYTE> buf;
+    getTokenInfo(token, TokenUser, buf);
+    auto pusr = (TOKEN_USER *)buf.data();
+    unqiue_local_membuf<wchar_t> stringUserSid;
+    if (!ConvertSidToStringSidW(pusr->User.Sid, std::out_ptr(stringUserSid)))
+        throwLastError("ConvertSidToStringSid");
+
+    getTokenInfo(token, TokenPrimaryGroup, buf);
+    auto * pgrp = (TOKEN_PRIMARY_GROUP *)buf.data();
+    unqiue_local_membuf<wchar_t> stringGroupSid;
+    if (!ConvertSidToStringSidW(pgrp->PrimaryGroup, std::out_ptr(stringGroupSid)))
+        throwLastError("ConvertSidToStringSid");
+
+    auto sddl = std::format(L"O:{0}G:{1}D:(A;;FA;;;SY)(A;;FA;;;BA)(A;;FA;;;{0})", stringUserSid.get(), stringGroupSid.get());
+
+    return makeSecurityDescriptor(sddl.c_str());
+}
+
+enum class ControlAction {
+    reply,
+    close,
+    stop
+};
+
+// Fixed buffer for a reply so that serving requests does not need to allocate
+class ControlReply {
+public:
+    void assign(std::string_view text) noexcept {
+        m_size = std::min(text.size(), sizeof(m_data));
+        memcpy(m_data, text.data(), m_size);
+    }
+    template<ProtocolMessage Message>
+    void assign(const Message & msg) noexcept 
+        { assign(messageBytes(msg)); }
+    template<class... Args>
+    void format(std::format_string<Args...> fmt, Args &&... args) {
+        auto res = std::format_to_n(m_data, sizeof(m_data), fmt, std::forward<Args>(args)...);
+        m_size = std::min(size_t(res.size), sizeof(m_data));
+    }
+
+    void clear() noexcept 
+        { m_size = 0; }
+
+    const char * data() const noexcept 
+        { return m_data; }
+    size_t size() const noexcept 
+        { return m_size; }
+private:
+    char m_data[g_maxMessageSize];
+    size_t m_size = 0;
+};
+
+// Runtime counters of an instance reported via StatsRequest.
+//
+// The counters are bumped on every connection, request and wakeup so they are plain relaxed 
+// atomics. They are only ever read as a whole by snapshot().
+class InstanceStats {
+public:
+    InstanceStats() noexcept:
+        m_startTick(GetTickCount64()) {
+
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        m_qpcPerUs = std::max(freq.QuadPart / 1'000'000, 1ll);
+    }
+    InstanceStats(const InstanceStats &) = delete;
+    InstanceStats & operator=(const InstanceStats &) = delete;
+
+    void connectionAccepted() noexcept 
+        { bump(m_connections); }
+    void wokeUp() noexcept 
+        { bump(m_wakeups); }
+    void malformedRequest() noexcept
+        { bump(m_malformed); }
+    void powerRequestAcquired() noexcept
+        { m_powerSince.store(GetTickCount64(), std::memory_order_relaxed); }
+
+    // startQpc is QueryPerformanceCounter() when handling began
+    void requestServed(std::string_view request, ControlAction action, LONGLONG startQpc) noexcept {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        auto elapsedUs = ULONGLONG(now.QuadPart - startQpc) / ULONGLONG(m_qpcPerUs);
+        auto bucket = size_t(std::ranges::upper_bound(g_statsLatencyBoundsUs, elapsedUs) - std::begin(g_statsLatencyBoundsUs));
+        bump(m_latency[bucket]);
+
+        if (action == ControlAction::close) 
+            bump(m_malformed);
+        else if (auto type = peekMessageType(request); !type) 
+            bump(m_legacyRequests);
+        else if (size_t(*type) < g_statsRequestTypes)
+            bump(m_requests[size_t(*type)]);
+    }
+
+    StatsReply snapshot() const noexcept {
+        auto reply = makeMessage<StatsReply>();
+        reply.connections = load(m_connections);
+        for (size_t i = 0; i < g_statsRequestTypes; ++i)
+            reply.requests[i] = load(m_requests[i]);
+        reply.legacyRequests = load(m_legacyRequests);
+        reply.malformed = load(m_malformed);
+        for (size_t i = 0; i < g_statsLatencyBuckets; ++i)
+            reply.latency[i] = load(m_latency[i]);
+        reply.wakeups = load(m_wakeups);
+
+        auto now = GetTickCount64();
+        reply.uptimeMs = now - m_startTick;
+        if (auto since = load(m_powerSince))
+            reply.powerRequestMs = now - since;
+
+        PROCESS_MEMORY_COUNTERS_EX memory{};
+        memory.cb = sizeof(memory);
+        if (GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS *>(&memory), sizeof(memory))) {
+            reply.workingSet = memory.WorkingSetSize;
+            reply.privateBytes = memory.PrivateUsage;
+        }
+        DWORD handles = 0;
+        if (GetProcessHandleCount(GetCurrentProcess(), &handles))
+            reply.handles = handles;
+        return reply;
+    }
+
+private:
+    static void bump(std::atomic<ULONGLONG> & counter) noexcept
+        { counter.fetch_add(1, std::memory_order_relaxed); }
+    static ULONGLONG load(const std::atomic<ULONGLONG> & counter) noexcept
+        { return counter.load(std::memory_order_relaxed); }
+
+private:
+    ULONGLONG m_startTick;
+    LONGLONG m_qpcPerUs;
+    std::atomic<ULONGLONG> m_connections = 0;
+    std::atomic<ULONGLONG> m_requests[g_statsRequestTypes] = {};
+    std::atomic<ULONGLONG> m_legacyRequests = 0;
+    std::atomic<ULONGLONG> m_malformed = 0;
+    std::atomic<ULONGLONG> m_latency[g_statsLatencyBuckets] = {};
+    std::atomic<ULONGLONG> m_wakeups = 0;
+    std::atomic<ULONGLONG> m_powerSince = 0;
+};
+
+// Single-threaded, event-driven server for the instance control pipe.
+//
+// One pipe instance is always kept listening for clients via an overlapped ConnectNamedPipe.
+// When a client connects, the instance is handed over to a Connection and a new one starts
+// listening. Connections do their I/O via ReadFileEx/WriteFileEx whose completion routines run
+// while the owner of the server is in an alertable wait. Thus any number of clients can be 
+// served concurrently without blocking each other or the instance's own deadline.
+class ControlServer {
+public:
+    using Handler = std::function<ControlAction (std::string_view request, ControlReply & reply)>;
+
+    static constexpr size_t maxConnections = 256;
+    static constexpr size_t maxRequestSize = 512;
+    static constexpr ULONGLONG connectionTimeout = 5'000;
+    static constexpr size_t reservedConnections = 8;
+
+    ControlServer(DWORD procId, Handler handler, InstanceStats * stats = nullptr):
+        ControlServer(makePipeName(procId), std::move(handler), stats)
+    {}
+
+    // Fails with ERROR_ACCESS_DENIED if the pipe name is already in use
+    ControlServer(std::wstring pipeName, Handler handler, InstanceStats * stats = nullptr):
+        m_pipeName(std::move(pipeName)),
+        m_desc(createPipeSecurityDescriptor()),
+        m_handler(std::move(handler)),
+        m_stats(stats)
+    {
+        m_connectEvent = CreateEvent(nullptr, true, false, nullptr);
+        if (!m_connectEvent)
+            throwLastError("CreateEvent");
+        if (!listen())
+            throwLastError("CreateNamedPipe");
+    }
+
+    ~ControlServer() noexcept {
+        m_shuttingDown = true;
+        if (m_listening && !m_alreadyConnected) {
+            CancelIoEx(m_listening.get(), &m_connectOvl);
+            DWORD dummy;
+            GetOverlappedResult(m_listening.get(), &m_connectOvl, &dummy, true);
+        }
+        for (auto it = m_connections.begin(); it != m_connections.end(); )
+            (it++)->close();
+        //let completion routines of the cancelled I/O run before the buffers go away
+        for (int i = 0; i < 50 && !m_connections.empty(); ++i)
+            SleepEx(10, true);
+    }
+    ControlServer(const ControlServer &) = delete;
+    ControlServer & operator=(const ControlServer &) = delete;
+
+    // Signaled when a client connects. Call acceptConnection() then.
+    HANDLE connectEvent() const 
+        { return m_connectEvent.get(); }
+
+    bool stopRequested() const 
+        { return m_stopRequested; }
+
+    // The earliest time any of the current connections expires
+    Deadline nextDeadline() const {
+        auto ret = Deadline::never();
+        for (auto & conn: m_connections) {
+            if (!conn.closing())
+                ret = std::min(ret, conn.deadline());
+        }
+        return ret;
+    }
+
+    void acceptConnection() {
+        ResetEvent(m_connectEvent.get());
+        if (!m_listening)
+            return;
+        DWORD dummy;
+        if (m_alreadyConnected || GetOverlappedResult(m_listening.get(), &m_connectOvl, &dummy, false)) {
+            auto it = m_connections.emplace(m_connections.end(), *this, std::move(m_listening));
+            if (m_stats)
+                m_stats->connectionAccepted();
+            it->start(it);
+        } else {
+            m_listening.reset();
+        }
+        //If we are at capacity the next instance will be created once some connection goes away.
+        //Meanwhile clients will see the pipe as busy.
+        if (!m_listening && m_connections.size() < maxConnections)
+            listen();
+    }
+
+    void expireConnections() {
+        for (auto it = m_connections.begin(); it != m_connections.end(); ) {
+            auto & conn = *it++;
+            if (conn.deadline().expired())
+                conn.close();
+        }
+    }
+
+private:
+    class Connection {
+    public:
+        Connection(ControlServer & server, AutoFile && pipe) noexcept:
+            m_server(server),
+            m_pipe(std::move(pipe)),
+            m_deadline(Deadline::after(connectionTimeout))
+        {}
+        Connection(const Connection &) = delete;
+        Connection & operator=(const Connection &) = delete;
+
+        const Deadline & deadline() const 
+            { return m_deadline; }
+        bool closing() const
+            { return m_closing; }
+
+        void start(std::pmr::list<Connection>::iterator self) {
+            m_self = self;
+            read();
+        }
+
+        void close() {
+            if (!m_ioPending) {
+                destroy();
+            } else if (!m_closing) {
+                //the completion routine will destroy us
+                m_closing = true;
+                CancelIoEx(m_pipe.get(), &m_ovl);
+            }
+        }
+
+    private:
+        void read() {
+            m_ovl = {};
+            m_ovl.hEvent = HANDLE(this); //ignored by ReadFileEx/WriteFileEx so we can use it for context
+            if (!ReadFileEx(m_pipe.get(), m_buffer, DWORD(sizeof(m_buffer)), &m_ovl, onRead)) {
+                destroy();
+                return;
+            }
+            m_ioPending = true;
+        }
+
+        void write() {
+            m_ovl = {};
+            m_ovl.hEvent = HANDLE(this);
+            if (!WriteFileEx(m_pipe.get(), m_reply.data(), DWORD(m_reply.size()), &m_ovl, onWritten)) {
+                destroy();
+                return;
+            }
+            m_ioPending = true;
+        }
+
+        static void CALLBACK onRead(DWORD err, DWORD size, OVERLAPPED * ovl) {
+            auto self = static_cast<Connection *>(ovl->hEvent);
+            self->m_ioPending = false;
+            //this also handles ERROR_MORE_DATA - requests are never that large
+            if (err != ERROR_SUCCESS || self->m_closing) {
+                if (err == ERROR_MORE_DATA && self->m_server.m_stats)
+                    self->m_server.m_stats->malformedRequest();
+                self->destroy();
+                return;
+            }
+            self->onRequest(std::string_view(self->m_buffer, size));
+        }
+
+        static void CALLBACK onWritten(DWORD err, DWORD /*size*/, OVERLAPPED * ovl) {
+            auto self = static_cast<Connection *>(ovl->hEvent);
+            self->m_ioPending = false;
+            if (err != ERROR_SUCCESS || self->m_closing) {
+                self->destroy();
+                return;
+            }
+            //Disconnecting now would discard the reply if the client hasn't read it yet.
+            //Instead wait for the client to close its end (or send another request).
+            self->m_deadline = Deadline::after(connectionTimeout);
+            self->read();
+        }
+
+        void onRequest(std::string_view request) {
+            ControlAction action = ControlAction::close;
+            TraceSpan span("serve request", "type", ULONGLONG(peekMessageType(request).value_or(MessageType(0))));
+            LARGE_INTEGER start;
+            QueryPerformanceCounter(&start);
+            try {
+                m_reply.clear();
+                action = m_server.m_handler(request, m_reply);
+            } catch (std::exception &) {
+                action = ControlAction::close;
+            }
+            if (m_server.m_stats)
+                m_server.m_stats->requestServed(request, action, start.QuadPart);
+            switch(action) {
+                case ControlAction::reply:
+                    write();
+                    break;
+                case ControlAction::stop:
+                    m_server.m_stopRequested = true;
+                    [[fallthrough]];
+                case ControlAction::close:
+                    destroy();
+                    break;
+            }
+        }
+
+        void destroy() 
+            { m_server.remove(m_self); }
+
+    private:
+        ControlServer & m_server;
+        std::pmr::list<Connection>::iterator m_self;
+        AutoFile m_pipe;
+        OVERLAPPED m_ovl{};
+        Deadline m_deadline;
+        bool m_ioPending = false;
+        bool m_closing = false;
+        char m_buffer[maxRequestSize];
+        ControlReply m_reply;
+    };
+
+    // Serves list nodes from a fixed free list of slots and from the process heap once they run out.
+    // Every node takes exactly one slot so, unlike with a pool resource, none of the reserved memory
+    // goes to rounding, chunk growth or bookkeeping.
+    class SlotResource : public std::pmr::memory_resource {
+    public:
+        SlotResource() noexcept {
+            for (auto & slot: m_slots) {
+                slot.next = m_free;
+                m_free = &slot;
+            }
+        }
+        SlotResource(const SlotResource &) = delete;
+        SlotResource & operator=(const SlotResource &) = delete;
+
+    private:
+        union Slot {
+            Slot * next;
+            alignas(std::max_align_t) std::byte node[sizeof(Connection) + 2 * sizeof(void *)]; //list links
+        };
+        //the list also allocates its sentinel node, and a debugging proxy in debug builds, from here
+        static constexpr size_t s_slotCount = reservedConnections + 2;
+
+        void * do_allocate(size_t bytes, size_t alignment) override {
+            if (m_free && bytes <= sizeof(Slot) && alignment <= alignof(Slot)) {
+                auto slot = m_free;
+                m_free = slot->next;
+                return slot;
+            }
+            return std::pmr::get_default_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void * ptr, size_t bytes, size_t alignment) override {
+            auto slot = static_cast<Slot *>(ptr);
+            std::less<Slot *> before;
+            if (!before(slot, std::begin(m_slots)) && before(slot, std::end(m_slots))) {
+                slot->next = m_free;
+                m_free = slot;
+                return;
+            }
+            std::pmr::get_default_resource()->deallocate(ptr, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override
+            { return this == &other; }
+
+    private:
+        Slot m_slots[s_slotCount];
+        Slot * m_free = nullptr;
+    };
+
+    bool listen() {
+        SECURITY_ATTRIBUTES sa;
+        sa.nLength = sizeof(sa);
+        sa.lpSecurityDescriptor = m_desc.get();
+        sa.bInheritHandle = false;
+
+        DWORD openMode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED;
+        if (m_firstInstance)
+            openMode |= FILE_FLAG_FIRST_PIPE_INSTANCE;
+        {
+            TraceSpan span("CreateNamedPipe");
+            m_listening = CreateNamedPipe(m_pipeName.c_str(), openMode,
+                                          PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                          PIPE_UNLIMITED_INSTANCES, 4096, 0, 
+                                          NMPWAIT_USE_DEFAULT_WAIT, &sa);
+        }
+        if (!m_listening)
+            return false;
+        m_firstInstance = false;
+
+        m_alreadyConnected = false;
+        m_connectOvl = {};
+        m_connectOvl.hEvent = m_connectEvent.get();
+        if (!ConnectNamedPipe(m_listening.get(), &m_connectOvl)) {
+            auto err = GetLastError();
+            if (err == ERROR_PIPE_CONNECTED) {
+                m_alreadyConnected = true;
+                SetEvent(m_connectEvent.get());
+            } else if (err != ERROR_IO_PENDING) {
+                m_listening.reset();
+                SetLastError(err);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void remove(std::pmr::list<Connection>::iterator it) {
+        m_connections.erase(it);
+        if (!m_listening && !m_shuttingDown)
+            listen();
+    }
+
+private:
+    std::wstring m_pipeName;
+    unqiue_local_membuf<SECURITY_DESCRIPTOR> m_desc;
+    Handler m_handler;
+    InstanceStats * m_stats;
+    AutoHandle m_connectEvent;
+    AutoFile m_listening;
+    OVERLAPPED m_connectOvl{};
+    bool m_firstInstance = true;
+    bool m_alreadyConnected = false;
+    bool m_stopRequested = false;
+    bool m_shuttingDown = false;
+    //Connections come and go for the whole life of the instance. Serve the usual handful of them 
+    //from slots reserved up front rather than growing and fragmenting the process heap.
+    SlotResource m_slots;
+    std::pmr::list<Connection> m_connections{&m_slots};
+};
+
+static RegistryRecord makeRegistryRecord(ULONGLONG startTick, ULONGLONG deadlineTick) {
+    RegistryRecord record{};
+    record.pid = GetCurrentProcessId();
+    if (!ProcessIdToSessionId(record.pid, &record.sessionId))
+        throwLastError("ProcessIdToSessionId");
+    FILETIME creation, exitTime, kernelTime, userTime;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exitTime, &kernelTime, &userTime))
+        throwLastError("GetProcessTimes");
+    record.creationTime = fileTimeToUInt64(creation);
+    record.startTick = startTick;
+    record.deadlineTick = deadlineTick;
+
+    std::vector<BYTE> buf;
+    getTokenInfo(GetCurrentProcessToken(), TokenUser, buf);
+    auto pusr = (TOKEN_USER *)buf.data();
+    if (!CopySid(sizeof(record.userSid), record.userSid, pusr->User.Sid))
+        throwLastError("CopySid");
+    return record;
+}
+
+static InfoReply makeInfoReply(const WaitTracker & tracker) noexcept {
+    auto reply = makeMessage<InfoReply>();
+    auto now = GetTickCount64();
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    auto wallNow = fileTimeToUInt64(ft);
+    reply.startTime = wallNow - (now - tracker.startTick()) * 10'000;
+    if (auto duration = tracker.duration()) {
+        reply.remainingMs = tracker.remaining().ms;
+        reply.deadline = wallNow + reply.remainingMs * 10'000;
+        reply.durationMs = *duration;
+    } else {
+        reply.remainingMs = g_protocolInfinite;
+        reply.deadline = g_protocolInfinite;
+        reply.durationMs = g_protocolInfinite;
+    }
+    reply.pid = GetCurrentProcessId();
+    reply.capabilities = capLegacyCommands | capInfo | capStop | capStats | capSetDeadline;
+    return reply;
+}
+
+// Called once the instance has detached from the launcher. From then on it only waits and serves
+// small requests so give back everything startup touched: there can be hundreds of us per machine.
+static void trimFootprint() noexcept {
+    g_stdout.release();
+    g_stderr.release();
+    _heapmin();
+    HeapCompact(GetProcessHeap(), 0);
+    //our pages are the first to go when the machine is short of memory
+    MEMORY_PRIORITY_INFORMATION priority{MEMORY_PRIORITY_LOW};
+    SetProcessInformation(GetCurrentProcess(), ProcessMemoryPriority, &priority, sizeof(priority));
+    SetProcessWorkingSetSize(GetCurrentProcess(), SIZE_T(-1), SIZE_T(-1));
+}
+
+static void runDirect(std::optional<ULONGLONG> duration, WaitClock clock, std::wstring_view conditions, LaunchReporter & reporter) {
+
+    //let the OS coalesce our expiration with other wakeups by up to 1% but no more than a second
+    WaitTracker tracker(duration, clock, duration ? std::min(*duration / 100, 1'000ull) : 0);
+    ConditionWaiter waiter(conditions);
+    InstanceStats stats;
+    // The registry is an optimization for discovery. If it is unavailable 
+    // we can still be found by enumerating processes.
+    auto registry = InstanceRegistry::open();
+
+    ControlServer server(GetCurrentProcessId(), [&tracker, &stats, &registry](std::string_view request, ControlReply & reply) {
+        if (auto type = peekMessageType(request)) {
+            switch(*type) {
+                case MessageType::infoRequest:
+                    reply.assign(makeInfoReply(tracker));
+                    return ControlAction::reply;
+                case MessageType::stopRequest:
+                    return ControlAction::stop;
+                case MessageType::statsRequest:
+                    reply.assign(stats.snapshot());
+                    return ControlAction::reply;
+                case MessageType::setDeadlineRequest: {
+                    SetDeadlineRequest change;
+                    if (!decodeMessage(request, change))
+                        return ControlAction::close;
+                    if (change.leaseId != 0 || !isValidDeadlineChange(change.change)) {
+                        auto error = makeMessage<ErrorReply>();
+                        error.code = change.leaseId != 0 ? ERROR_NOT_FOUND : ERROR_INVALID_PARAMETER;
+                        reply.assign(error);
+                        return ControlAction::reply;
+                    }
+                    auto current = tracker.duration() ? std::optional(tracker.remaining().ms) : std::nullopt;
+                    if (auto remaining = applyDeadlineChange(current, change.change, change.durationMs); remaining != current) {
+                        tracker.setRemaining(*remaining);
+                        if (registry)
+                            registry->publish(makeRegistryRecord(tracker.startTick(), tracker.deadlineTick()));
+                    }
+                    reply.assign(makeInfoReply(tracker));
+                    return ControlAction::reply;
+                }
+                default: {
+                    auto error = makeMessage<ErrorReply>();
+                    error.code = ERROR_NOT_SUPPORTED;
+                    reply.assign(error);
+                    return ControlAction::reply;
+                }
+            }
+        }
+        if (request == "info") {
+            reply.format("{}", tracker.remaining());
+            return ControlAction::reply;
+        }
+        if (request == "stop")
+            return ControlAction::stop;
+        return ControlAction::close;
+    }, &stats);
+        
+    auto oldState = SetThreadExecutionState(ES_CONTINUOUS | ES_SYSTEM_REQUIRED);
+    if (oldState == 0)
+        throwLastError("SetThreadExecutionState");
+    stats.powerRequestAcquired();
+
+    if (registry)
+        registry->publish(makeRegistryRecord(tracker.startTick(), tracker.deadlineTick()));
+
+    //Let the launcher go, exceptions will not be reported from this point on
+    reporter.started(duration);
+    trimFootprint();
+        
+    while(!server.stopRequested() && !tracker.isDone() && !waiter.isDone()) {
+
+        // Connection I/O completes in APCs while we are in alertable wait here. Otherwise we only wake up 
+        // for new connections, connection timeouts, our own expiration and conditions that ended.
+        HANDLE handles[MAXIMUM_WAIT_OBJECTS] = {server.connectEvent()};
+        DWORD count = 1;
+        if (tracker.timer())
+            handles[count++] = tracker.timer();
+        auto conditionsStart = count;
+        for (auto handle: waiter.handles())
+            handles[count++] = handle;
+        auto res = WaitForMultipleObjectsEx(count, handles, false, server.nextDeadline().remaining(), true);
+        stats.wokeUp();
+        if (res == WAIT_OBJECT_0)
+            server.acceptConnection();
+        else if (res >= WAIT_OBJECT_0 + conditionsStart && res < WAIT_OBJECT_0 + count)
+            waiter.signaled(res - WAIT_OBJECT_0 - conditionsStart);
+        else if (res == WAIT_FAILED)
+            break;
+        server.expireConnections();
+    }
+    
+    SetThreadExecutionState(ES_CONTINUOUS);
+        
+}
+
+
+#pragma endregion
+
+#pragma region Instance Queries
+
+// Requests from the command line open a new connection each
+struct TracedPipeTransport : PipeTransport {
+    DWORD exchange(DWORD pid, std::string_view request, const Deadline & deadline, std::span<char> buf, std::string_view & reply) {
+        TraceSpan span("instance request", "pid", pid);
+        return PipeTransport::exchange(pid, request, deadline, buf, reply);
+    }
+};
+static TracedPipeTransport g_instancePipes;
+
+// How long a launcher waits for the broker to grant a lease
+constexpr ULONGLONG g_brokerAttachTimeout = 5'000;
+
+// Obtains a lease from the current user's broker, if one is running
+static DWORD acquireLease(std::optional<ULONGLONG> duration, const Deadline & deadline, AcquireLeaseReply & reply) {
+    auto request = makeMessage<AcquireLeaseRequest>();
+    request.durationMs = duration.value_or(g_protocolInfinite);
+
+    PipeConnection conn(deadline);
+    if (auto err = conn.open(makeBrokerPipeName()); err != ERROR_SUCCESS)
+        return err;
+    if (auto err = conn.write(messageBytes(request)); err != ERROR_SUCCESS)
+        return err;
+    char buf[g_maxMessageSize];
+    size_t size;
+    if (auto err = conn.read(buf, size); err != ERROR_SUCCESS)
+        return err;
+    if (!decodeMessage(std::string_view(buf, size), reply))
+        return ERROR_INVALID_DATA;
+    return ERROR_SUCCESS;
+}
+
+#pragma endregion
+
+#pragma region Broker
+
+// Leases held by a broker.
+//
+// The broker keeps the machine awake for as long as it holds any lease, so the leases effectively 
+// reference count its single power request. Expirations are kept in a min-heap whose top arms a 
+// waitable timer. Released leases are removed from the heap lazily.
+class LeaseSet {
+public:
+    LeaseSet() {
+        m_timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_MANUAL_RESET, TIMER_ALL_ACCESS);
+        if (!m_timer)
+            throwLastError("CreateWaitableTimerEx");
+    }
+    LeaseSet(const LeaseSet &) = delete;
+    LeaseSet & operator=(const LeaseSet &) = delete;
+
+    // Signaled when the earliest lease is due to expire. Call expire() then.
+    HANDLE timer() const 
+        { return m_timer.get(); }
+
+    bool empty() const 
+        { return m_leases.empty(); }
+
+    // Incremented whenever leases change
+    ULONGLONG version() const 
+        { return m_version; }
+
+    DWORD acquire(std::optional<ULONGLONG> duration) {
+        auto id = m_nextId++;
+        auto now = GetTickCount64();
+        auto & lease = m_leases[id];
+        lease.startTick = now;
+        lease.duration = duration;
+        lease.deadlineTick = duration && *duration < g_infiniteTick - now ? now + *duration : g_infiniteTick;
+        if (lease.deadlineTick != g_infiniteTick) {
+            m_expirations.emplace_back(lease.deadlineTick, id);
+            std::ranges::push_heap(m_expirations, std::greater{});
+            arm();
+        }
+        ++m_version;
+        return id;
+    }
+
+    bool release(DWORD id) {
+        if (!m_leases.erase(id))
+            return false;
+        ++m_version;
+        //don't let stale heap entries accumulate
+        if (m_expirations.size() > 2 * m_leases.size() + 16) {
+            std::erase_if(m_expirations, [&](const Expiration & exp) { return !isLive(exp); });
+            std::ranges::make_heap(m_expirations, std::greater{});
+            arm();
+        }
+        return true;
+    }
+
+    // Removes all leases that are due
+    void expire() {
+        auto now = GetTickCount64();
+        while (!m_expirations.empty() && m_expirations.front().first <= now) {
+            std::ranges::pop_heap(m_expirations, std::greater{});
+            auto exp = m_expirations.back();
+            m_expirations.pop_back();
+            if (isLive(exp)) {
+                m_leases.erase(exp.second);
+                ++m_version;
+            }
+        }
+        arm();
+    }
+
+    // The latest deadline of all leases
+    ULONGLONG deadlineTick() const {
+        ULONGLONG ret = 0;
+        for (auto & [id, lease]: m_leases)
+            ret = std::max(ret, lease.deadlineTick);
+        return ret;
+    }
+
+    void list(DWORD firstLease, ListLeasesReply & reply) const {
+        auto now = GetTickCount64();
+        reply.count = 0;
+        reply.more = 0;
+        for (auto it = m_leases.lower_bound(firstLease); it != m_leases.end(); ++it) {
+            if (reply.count == std::size(reply.leases)) {
+                reply.more = 1;
+                break;
+            }
+            describe(it->first, it->second, now, reply.leases[reply.count++]);
+        }
+    }
+
+    // Moves the expiration of a lease in place. Returns false if there is no such lease.
+    bool changeDeadline(DWORD id, DeadlineChange change, ULONGLONG durationMs, LeaseInfo & info) {
+        auto it = m_leases.find(id);
+        if (it == m_leases.end())
+            return false;
+        auto & lease = it->second;
+        auto now = GetTickCount64();
+        auto current = lease.deadlineTick == g_infiniteTick ? std::nullopt : 
+                       std::optional(lease.deadlineTick > now ? lease.deadlineTick - now : 0);
+        auto remaining = applyDeadlineChange(current, change, durationMs);
+        if (remaining != current) {
+            //the old heap entry is no longer live since the deadline differs
+            lease.deadlineTick = *remaining < g_infiniteTick - now ? now + *remaining : g_infiniteTick;
+            if (lease.deadlineTick != g_infiniteTick) {
+                lease.duration = lease.deadlineTick - lease.startTick;
+                m_expirations.emplace_back(lease.deadlineTick, id);
+                std::ranges::push_heap(m_expirations, std::greater{});
+            } else {
+                //a deadline too far away to represent means the lease no longer has one
+                lease.duration = std::nullopt;
+            }
+            arm();
+            ++m_version;
+        }
+        describe(id, lease, now, info);
+        return true;
+    }
+
+private:
+    struct Lease {
+        ULONGLONG startTick;
+        std::optional<ULONGLONG> duration;
+        ULONGLONG deadlineTick;
+    };
+    using Expiration = std::pair<ULONGLONG, DWORD>;     //deadline tick, lease id
+
+    static void describe(DWORD id, const Lease & lease, ULONGLONG now, LeaseInfo & info) {
+        info.leaseId = id;
+        info.remainingMs = lease.deadlineTick == g_infiniteTick ? g_protocolInfinite : 
+                           lease.deadlineTick > now ? lease.deadlineTick - now : 0;
+        info.durationMs = lease.duration.value_or(g_protocolInfinite);
+        info.ageMs = now - lease.startTick;
+    }
+
+    bool isLive(const Expiration & exp) const {
+        auto it = m_leases.find(exp.second);
+        return it != m_leases.end() && it->second.deadlineTick == exp.first;
+    }
+
+    void arm() {
+        if (m_expirations.empty()) {
+            //setting the timer is the only way to reset it
+            LARGE_INTEGER never;
+            never.QuadPart = std::numeric_limits<LONGLONG>::min();
+            if (!SetWaitableTimerEx(m_timer.get(), &never, 0, nullptr, nullptr, nullptr, 0))
+                throwLastError("SetWaitableTimerEx");
+            CancelWaitableTimer(m_timer.get());
+            return;
+        }
+        auto now = GetTickCount64();
+        auto deadline = m_expirations.front().first;
+        LARGE_INTEGER due;
+        due.QuadPart = -LONGLONG(deadline > now ? (deadline - now) * 10'000 : 0);
+        if (!SetWaitableTimerEx(m_timer.get(), &due, 0, nullptr, nullptr, nullptr, 0))
+            throwLastError("SetWaitableTimerEx");
+    }
+
+private:
+    std::map<DWORD, Lease> m_leases;
+    std::vector<Expiration> m_expirations;  //min-heap
+    AutoHandle m_timer;
+    DWORD m_nextId = 1;
+    ULONGLONG m_version = 0;
+};
+
+static void printStarted(bool useColor, std::optional<ULONGLONG> duration, DWORD pid) {
+    if (duration) 
+        wprint(stdout, L"{0}preventing sleep for{1} {2}{4}{1} {0}or until process{1} {3}{5}{1} {0}is stopped{1}\n",
+            makeWColor<KA_COLOR_SUCCESS>(useColor),
+            makeWColor<Color::normal>(useColor),
+            makeWColor<KA_COLOR_DURATION>(useColor),
+            makeWColor<KA_COLOR_PID>(useColor),
+            Duration{*duration}, 
+            pid);
+    else
+        wprint(stdout, L"{0}preventing sleep indefinitely or until process{1} {2}{3}{1} {0}is stopped{1}\n",
+            makeWColor<KA_COLOR_SUCCESS>(useColor),
+            makeWColor<Color::normal>(useColor),
+            makeWColor<KA_COLOR_PID>(useColor),
+            pid);
+}
+
+static void printLeaseGranted(bool useColor, std::optional<ULONGLONG> duration, DWORD brokerPid, DWORD leaseId) {
+    if (duration) 
+        wprint(stdout, L"{0}preventing sleep for{1} {2}{4}{1} {0}or until lease{1} {3}{5}:{6}{1} {0}is stopped{1}\n",
+            makeWColor<KA_COLOR_SUCCESS>(useColor),
+            makeWColor<Color::normal>(useColor),
+            makeWColor<KA_COLOR_DURATION>(useColor),
+            makeWColor<KA_COLOR_PID>(useColor),
+            Duration{*duration}, 
+            brokerPid,
+            leaseId);
+    else
+        wprint(stdout, L"{0}preventing sleep indefinitely or until lease{1} {2}{3}:{4}{1} {0}is stopped{1}\n",
+            makeWColor<KA_COLOR_SUCCESS>(useColor),
+            makeWColor<Color::normal>(useColor),
+            makeWColor<KA_COLOR_PID>(useColor),
+            brokerPid,
+            leaseId);
+}
+
+// Broker mode: a single long-lived process per user that holds the power request on behalf of 
+// many invocations. The first lease is for the invocation that started the broker. 
+// It exits once it holds no leases.
+static void runBroker(std::optional<ULONGLONG> duration, LaunchReporter & reporter) {
+
+    auto startTick = GetTickCount64();
+    LeaseSet leases;
+    InstanceStats stats;
+
+    auto makeBrokerInfoReply = [&]() {
+        auto reply = makeMessage<InfoReply>();
+        auto now = GetTickCount64();
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft);
+        auto wallNow = fileTimeToUInt64(ft);
+        reply.startTime = wallNow - (now - startTick) * 10'000;
+        if (auto deadline = leases.deadlineTick(); deadline != g_infiniteTick) {
+            reply.remainingMs = deadline > now ? deadline - now : 0;
+            reply.deadline = wallNow + reply.remainingMs * 10'000;
+        } else {
+            reply.remainingMs = g_protocolInfinite;
+            reply.deadline = g_protocolInfinite;
+        }
+        reply.durationMs = g_protocolInfinite;
+        reply.pid = GetCurrentProcessId();
+        reply.capabilities = capLegacyCommands | capInfo | capStop | capLeases | capStats | capSetDeadline;
+        return reply;
+    };
+
+    auto handler = [&](std::string_view request, ControlReply & reply) {
+        if (auto type = peekMessageType(request)) {
+            switch(*type) {
+                case MessageType::infoRequest:
+                    reply.assign(makeBrokerInfoReply());
+                    return ControlAction::reply;
+                case MessageType::stopRequest:
+                    return ControlAction::stop;
+                case MessageType::statsRequest:
+                    reply.assign(stats.snapshot());
+                    return ControlAction::reply;
+                case MessageType::acquireLeaseRequest: {
+                    AcquireLeaseRequest acquire;
+                    if (!decodeMessage(request, acquire))
+                        return ControlAction::close;
+                    auto granted = makeMessage<AcquireLeaseReply>();
+                    granted.leaseId = leases.acquire(acquire.durationMs == g_protocolInfinite ? std::nullopt : std::optional(acquire.durationMs));
+                    granted.pid = GetCurrentProcessId();
+                    reply.assign(granted);
+                    return ControlAction::reply;
+                }
+                case MessageType::listLeasesRequest: {
+                    ListLeasesRequest list;
+                    if (!decodeMessage(request, list))
+                        return ControlAction::close;
+                    auto listed = makeMessage<ListLeasesReply>();
+                    leases.list(list.firstLease, listed);
+                    reply.assign(listed);
+                    return ControlAction::reply;
+                }
+                case MessageType::releaseLeaseRequest: {
+                    ReleaseLeaseRequest release;
+                    if (!decodeMessage(request, release))
+                        return ControlAction::close;
+                    auto result = makeMessage<ErrorReply>();
+                    result.code = leases.release(release.leaseId) ? ERROR_SUCCESS : ERROR_NOT_FOUND;
+                    reply.assign(result);
+                    return ControlAction::reply;
+                }
+                case MessageType::setDeadlineRequest: {
+                    //the broker's own deadline is that of its leases so only those can be changed
+                    SetDeadlineRequest change;
+                    if (!decodeMessage(request, change))
+                        return ControlAction::close;
+                    LeaseInfo lease;
+                    if (change.leaseId == 0 || !isValidDeadlineChange(change.change) || 
+                        !leases.changeDeadline(change.leaseId, change.change, change.durationMs, lease)) {
+                        auto error = makeMessage<ErrorReply>();
+                        error.code = change.leaseId == 0 ? ERROR_NOT_SUPPORTED : 
+                                     !isValidDeadlineChange(change.change) ? ERROR_INVALID_PARAMETER : ERROR_NOT_FOUND;
+                        reply.assign(error);
+                        return ControlAction::reply;
+                    }
+                    auto info = makeBrokerInfoReply();
+                    FILETIME ft;
+                    GetSystemTimeAsFileTime(&ft);
+                    auto wallNow = fileTimeToUInt64(ft);
+                    info.remainingMs = lease.remainingMs;
+                    info.deadline = lease.remainingMs == g_protocolInfinite ? g_protocolInfinite : wallNow + lease.remainingMs * 10'000;
+                    info.startTime = wallNow - lease.ageMs * 10'000;
+                    info.durationMs = lease.durationMs;
+                    reply.assign(info);
+                    return ControlAction::reply;
+                }
+                default: {
+                    auto error = makeMessage<ErrorReply>();
+                    error.code = ERROR_NOT_SUPPORTED;
+                    reply.assign(error);
+                    return ControlAction::reply;
+                }
+            }
+        }
+        if (request == "info") {
+            auto deadline = leases.deadlineTick();
+            reply.format("{}", remainingUntil(deadline, GetTickCount64()));
+            return ControlAction::reply;
+        }
+        if (request == "stop")
+            return ControlAction::stop;
+        return ControlAction::close;
+    };
+
+    std::unique_ptr<ControlServer> shared;
+    for (int attempt = 0; !shared; ++attempt) {
+        try {
+            shared = std::make_unique<ControlServer>(makeBrokerPipeName(), handler, &stats);
+        } catch (std::system_error & ex) {
+            if (ex.code().value() != ERROR_ACCESS_DENIED)
+                throw;
+            //Another broker started in the meantime: use it instead. 
+            //If it is on its way out, try to take over once it is gone.
+            AcquireLeaseReply granted;
+            auto err = acquireLease(duration, Deadline::after(g_brokerAttachTimeout), granted);
+            if (err == ERROR_SUCCESS) {
+                reporter.leased(granted.pid, granted.leaseId, duration);
+                return;
+            }
+            if (attempt == 2)
+                throwWin32Error(err, "acquiring lease from broker");
+            Sleep(100);
+        }
+    }
+    ControlServer server(GetCurrentProcessId(), handler, &stats);
+
+    auto firstLease = leases.acquire(duration);
+        
+    auto oldState = SetThreadExecutionState(ES_CONTINUOUS | ES_SYSTEM_REQUIRED);
+    if (oldState == 0)
+        throwLastError("SetThreadExecutionState");
+    stats.powerRequestAcquired();
+
+    auto registry = InstanceRegistry::open();
+    auto publish = [&]() {
+        if (!registry)
+            return;
+        auto record = makeRegistryRecord(startTick, leases.deadlineTick());
+        record.flags = registryBroker;
+        registry->publish(record);
+    };
+    publish();
+    auto publishedVersion = leases.version();
+
+    //Let the launcher go, exceptions will not be reported from this point on
+    reporter.leased(GetCurrentProcessId(), firstLease, duration);
+    trimFootprint();
+        
+    while(!server.stopRequested() && !shared->stopRequested() && !leases.empty()) {
+
+        HANDLE handles[] = {server.connectEvent(), shared->connectEvent(), leases.timer()};
+        auto wakeAt = std::min(server.nextDeadline(), shared->nextDeadline());
+        auto res = WaitForMultipleObjectsEx(DWORD(std::size(handles)), handles, false, wakeAt.remaining(), true);
+        stats.wokeUp();
+        if (res == WAIT_OBJECT_0)
+            server.acceptConnection();
+        else if (res == WAIT_OBJECT_0 + 1)
+            shared->acceptConnection();
+        else if (res == WAIT_OBJECT_0 + 2)
+            leases.expire();
+        else if (res == WAIT_FAILED)
+            break;
+        server.expireConnections();
+        shared->expireConnections();
+
+        if (leases.version() != publishedVersion) {
+            publish();
+            publishedVersion = leases.version();
+        }
+    }
+    
+    SetThreadExecutionState(ES_CONTINUOUS);
+}
+
+#pragma endregion
+
+#pragma region Account Names
+
+static std::wstring sidToString(PSID psid) {
+    unqiue_local_membuf<wchar_t> stringSid;
+    if (!ConvertSidToStringSidW(psid, std::out_ptr(stringSid)))
+        return L"<unknown>";
+    return stringSid.get();
+}
+
+static std::optional<std::wstring> lookupAccountName(PSID psid) {
+    TraceSpan span("lookupAccountName");
+    std::wstring name, domain;
+    name.resize(64);
+    domain.resize(64);
+
+    while (true) {
+        DWORD nameSize = DWORD(name.size()), domainSize = DWORD(domain.size());
+        SID_NAME_USE use;
+        if (LookupAccountSidW(nullptr, psid, name.data(), &nameSize, domain.data(), &domainSize, &use)) {
+            name.resize(wcslen(name.c_str()));
+            domain.resize(wcslen(domain.c_str()));
+            break;
+        }
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+            return std::nullopt;
+        name.resize(nameSize);
+        domain.resize(domainSize);
+    }
+    return domain + L'\\' + name;
+}
+
+// Resolves user SIDs to account names.
+//
+// LookupAccountSid may need to talk to a domain controller so every distinct SID is looked up 
+// at most once, all lookups run concurrently and the ones that do not complete before a deadline
+// are shown as string SIDs. Resolved names are also remembered in a per-user file for a limited 
+// time so that subsequent runs usually do not need to look anything up at all.
+class AccountNameCache {
+public:
+    // ttl of 0 disables the persistent cache
+    explicit AccountNameCache(ULONGLONG ttl):
+        m_ttl(ttl) {
+        
+        if (m_ttl)
+            load();
+    }
+    AccountNameCache(const AccountNameCache &) = delete;
+    AccountNameCache & operator=(const AccountNameCache &) = delete;
+
+    ~AccountNameCache() noexcept {
+        if (m_ttl && m_dirty)
+            save();
+    }
+
+    // Makes sure all the given SIDs have names
+    void resolve(std::span<const PSID> sids, const Deadline & deadline) {
+        auto batch = std::make_shared<LookupBatch>();
+        for (auto psid: sids) {
+            if (!psid)
+                continue;
+            auto key = keyOf(psid);
+            if (m_entries.contains(key) || std::ranges::find(batch->keys, key) != batch->keys.end())
+                continue;
+            batch->keys.push_back(std::move(key));
+        }
+        if (batch->keys.empty())
+            return;
+
+        batch->names.resize(batch->keys.size());
+        batch->done = std::make_unique<std::atomic<bool>[]>(batch->keys.size());
+        batch->outstanding = batch->keys.size();
+        batch->finished = CreateEventW(nullptr, true, false, nullptr);
+        if (!batch->finished)
+            throwLastError("CreateEvent");
+
+        //Lookups that miss the deadline are left running on their own. They keep the batch alive until they complete.
+        for (size_t i = 0; i < batch->keys.size(); ++i) {
+            std::thread([batch, i]() noexcept {
+                try {
+                    batch->names[i] = lookupAccountName(PSID(batch->keys[i].data()));
+                } catch (std::exception &) {
+                }
+                batch->done[i].store(true, std::memory_order_release);
+                if (batch->outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    SetEvent(batch->finished.get());
+            }).detach();
+        }
+        WaitForSingleObject(batch->finished.get(), deadline.remaining());
+
+        auto expires = currentFileTime() + m_ttl * 10'000;
+        for (size_t i = 0; i < batch->keys.size(); ++i) {
+            auto & key = batch->keys[i];
+            if (!batch->done[i].load(std::memory_order_acquire)) {
+                m_entries.emplace(std::move(key), Entry{sidToString(PSID(key.data())), 0});
+                continue;
+            }
+            if (auto & name = batch->names[i]) {
+                m_entries.emplace(std::move(key), Entry{std::move(*name), expires});
+                m_dirty = true;
+            } else {
+                m_entries.emplace(std::move(key), Entry{sidToString(PSID(key.data())), 0});
+            }
+        }
+    }
+
+    // Name of a SID previously passed to resolve()
+    std::wstring nameOf(PSID psid) const {
+        if (!psid)
+            return L"<unknown>";
+        auto it = m_entries.find(keyOf(psid));
+        if (it == m_entries.end())
+            return sidToString(psid);
+        return it->second.name;
+    }
+
+private:
+    using Key = std::basic_string<BYTE>;
+
+    struct Entry {
+        std::wstring name;
+        ULONGLONG expires;  //UTC FILETIME or 0 if the name should not be persisted
+    };
+
+    struct LookupBatch {
+        std::vector<Key> keys;
+        std::vector<std::optional<std::wstring>> names;
+        std::unique_ptr<std::atomic<bool>[]> done;
+        std::atomic<size_t> outstanding;
+        AutoHandle finished;
+    };
+
+    static Key keyOf(PSID psid) {
+        return Key(reinterpret_cast<const BYTE *>(psid), GetLengthSid(psid));
+    }
+
+    static ULONGLONG currentFileTime() noexcept {
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft);
+        return fileTimeToUInt64(ft);
+    }
+
+    static std::optional<std::wstring> cachePath() {
+        std::wstring dir;
+        dir.resize(MAX_PATH);
+        auto size = GetEnvironmentVariableW(L"LOCALAPPDATA", dir.data(), DWORD(dir.size()));
+        if (size == 0 || size >= dir.size())
+            return std::nullopt;
+        dir.resize(size);
+        dir += L"\\keep-awake";
+        if (!CreateDirectoryW(dir.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+            return std::nullopt;
+        return dir + L"\\accounts.cache";
+    }
+
+    // The file consists of lines in the form: "<expiration FILETIME>\t<string SID>\t<name>\n"
+    void load() noexcept {
+        try {
+            auto path = cachePath();
+            if (!path)
+                return;
+            AutoFile file = CreateFileW(path->c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (!file)
+                return;
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(file.get(), &fileSize) || fileSize.QuadPart > 1024 * 1024)
+                return;
+            std::string content(size_t(fileSize.QuadPart), '\0');
+            DWORD read;
+            if (!ReadFile(file.get(), content.data(), DWORD(content.size()), &read, nullptr))
+                return;
+            content.resize(read);
+
+            auto now = currentFileTime();
+            for (auto line: std::views::split(std::string_view(content), '\n')) {
+                auto fields = std::string_view(line.begin(), line.end()) | std::views::split('\t');
+                std::string_view parts[3];
+                size_t count = 0;
+                for (auto field: fields) {
+                    if (count == std::size(parts))
+                        break;
+                    parts[count++] = std::string_view(field.begin(), field.end());
+                }
+                if (count != std::size(parts))
+                    continue;
+                ULONGLONG expires;
+                auto [ptr, ec] = std::from_chars(parts[0].data(), parts[0].data() + parts[0].size(), expires);
+                if (ec != std::errc() || ptr != parts[0].data() + parts[0].size() || expires <= now)
+                    continue;
+                unqiue_local_membuf<SID> psid;
+                if (!ConvertStringSidToSidW(widen(parts[1]).c_str(), std::out_ptr<PSID>(psid)))
+                    continue;
+                m_entries.emplace(keyOf(psid.get()), Entry{widen(parts[2]), expires});
+            }
+        } catch (std::exception &) {
+        }
+    }
+
+    void save() noexcept {
+        try {
+            auto path = cachePath();
+            if (!path)
+                return;
+            std::string content;
+            for (auto & [key, entry]: m_entries) {
+                if (!entry.expires)
+                    continue;
+                content += std::format("{}\t{}\t{}\n", entry.expires, narrow(sidToString(PSID(key.data()))), narrow(entry.name));
+            }
+            //Write to a temporary file and replace so concurrent readers never see a partial file
+            auto tempPath = std::format(L"{}.{}", *path, GetCurrentProcessId());
+            {
+                AutoFile file = CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 
+                                            FILE_ATTRIBUTE_NORMAL | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED, nullptr);
+                if (!file)
+                    return;
+                DWORD written;
+                if (!WriteFile(file.get(), content.data(), DWORD(content.size()), &written, nullptr) || 
+                    written != content.size()) {
+                    file.reset();
+                    DeleteFileW(tempPath.c_str());
+                    return;
+                }
+            }
+            if (!MoveFileExW(tempPath.c_str(), path->c_str(), MOVEFILE_REPLACE_EXISTING))
+                DeleteFileW(tempPath.c_str());
+        } catch (std::exception &) {
+        }
+    }
+
+private:
+    std::map<Key, Entry> m_entries;
+    ULONGLONG m_ttl;
+    bool m_dirty = false;
+};
+
+// How long resolved account names are remembered across runs. 
+// Can be overridden via KEEP_AWAKE_ACCOUNT_CACHE_TTL environment variable, 0 disables.
+static ULONGLONG accountCacheTtl() {
+    constexpr ULONGLONG defaultTtl = 60 * 60 * 1000;
+
+    wchar_t buf[64];
+    auto size = GetEnvironmentVariableW(L"KEEP_AWAKE_ACCOUNT_CACHE_TTL", buf, DWORD(std::size(buf)));
+    if (size == 0 || size >= std::size(buf))
+        return defaultTtl;
+    return parseDuration(std::wstring_view(buf, size)).value_or(defaultTtl);
+}
+
+#pragma endregion
+
+#pragma region Main Code
+
+// Starts the background instance and reports how that went once it tells us
+static void runChild(ChildSettings settings, std::span<const WaitCondition> conditions, ColorStatus envColorStatus) {
+    SECURITY_ATTRIBUTES pipeAttr;
+    pipeAttr.nLength = sizeof(pipeAttr); 
+    pipeAttr.bInheritHandle = true; 
+    pipeAttr.lpSecurityDescriptor = nullptr; 
+
+    AutoFile hRead, hWrite;
+    if (!CreatePipe(&hRead.out(), &hWrite.out(), &pipeAttr, 0))
+        throwLastError("CreatePipe");
+    if (!SetHandleInformation(hRead.get(), HANDLE_FLAG_INHERIT, 0))
+        throwLastError("SetHandleInformation(read pipe)");
+
+    settings.reportPipe = ULONGLONG(uintptr_t(hWrite.get()));
+    if (!SetEnvironmentVariable(g_myGuid, settings.encode().c_str()))
+        throwLastError("SetEnvironmentVariable");
+    if (Tracer::enabled() && !SetEnvironmentVariable(traceEnvVarName().c_str(), Tracer::path().c_str()))
+        throwLastError("SetEnvironmentVariable");
+    if (!conditions.empty() && !SetEnvironmentVariable(conditionsEnvVarName().c_str(), encodeConditions(conditions).c_str()))
+        throwLastError("SetEnvironmentVariable");
+
+    std::wstring exe = myname();
+
+    for(DWORD id: {STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE}) {
+        auto h = GetStdHandle(id);
+        if (h == nullptr || h == INVALID_HANDLE_VALUE)
+            continue;
+        if (!SetHandleInformation(h, HANDLE_FLAG_INHERIT, 0))
+            throwLastError("SetHandleInformation(std handle)");
+    }
+    
+    //The child reports through the pipe only and has no standard handles
+    STARTUPINFOW si{};
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = INVALID_HANDLE_VALUE;
+    si.hStdOutput = INVALID_HANDLE_VALUE;
+    si.hStdError = INVALID_HANDLE_VALUE;
+    PROCESS_INFORMATION pi;
+
+    std::wstring cmdline = GetCommandLine();
+
+    {
+        TraceSpan span("CreateProcess");
+        DWORD flags = CREATE_DEFAULT_ERROR_MODE | CREATE_NO_WINDOW | DETACHED_PROCESS;
+        //The shared instance serves every session of the user so it must not be killed with the job
+        //of the session that happened to start it (e.g. an SSH session). An instance waiting for a process
+        //tree must not end up in the job tracking that tree either, should we somehow be in it, or the job
+        //would never become empty. Tracking jobs allow breakaway, other jobs might not.
+        bool breakaway = settings.isShared() || std::ranges::any_of(conditions, [](const WaitCondition & condition) {
+            return condition.kind == WaitConditionKind::tree;
+        });
+        bool created = false;
+        if (breakaway) {
+            created = CreateProcess(exe.data(), cmdline.data(), nullptr, nullptr, true, flags | CREATE_BREAKAWAY_FROM_JOB, nullptr, nullptr, &si, &pi) != FALSE;
+            if (!created && GetLastError() != ERROR_ACCESS_DENIED)
+                throwLastError("CreateProcess");
+        }
+        if (!created && !CreateProcess(exe.data(), cmdline.data(), nullptr, nullptr, true, flags, nullptr, nullptr, &si, &pi))
+            throwLastError("CreateProcess");
+    }
+    AutoHandle process(pi.hProcess);
+    CloseHandle(pi.hThread);
+    hWrite.reset();
+
+    LaunchReport report;
+    size_t received = 0;
+    {
+        TraceSpan span("wait for child report");
+        while (received < sizeof(report)) {
+            DWORD read;
+            if (!ReadFile(hRead.get(), reinterpret_cast<char *>(&report) + received, DWORD(sizeof(report) - received), &read, nullptr) || read == 0)
+                break;
+            received += read;
+        }
+    }
+    if (received < sizeof(report)) {
+        //the child died without saying anything
+        WaitForSingleObject(process.get(), INFINITE);
+        DWORD exitCode = 0;
+        GetExitCodeProcess(process.get(), &exitCode);
+        throw std::runtime_error(std::format("background process exited unexpectedly with code 0x{:X}", exitCode));
+    }
+
+    auto useColor = shouldUseColor(envColorStatus, stdout);
+    switch(report.type) {
+        case LaunchReport::started:
+            printStarted(useColor, settings.duration(), report.pid);
+            break;
+        case LaunchReport::leased:
+            printLeaseGranted(useColor, settings.duration(), report.pid, report.leaseId);
+            break;
+        default:
+            report.message[std::size(report.message) - 1] = 0;
+            throw std::runtime_error(std::format("(child): {}", report.message));
+    }
+    g_stdout.flush();
+}
+
+struct InstanceId {
+    DWORD pid = 0;
+    std::optional<DWORD> leaseId;
+};
+
+// Parses pid[:lease]
+static std::optional<InstanceId> parseInstanceId(std::wstring_view str) {
+    auto parseNumber = [](std::wstring_view digits) -> std::optional<DWORD> {
+        if (digits.empty())
+            return std::nullopt;
+        ULONGLONG value = 0;
+        for (auto c: digits) {
+            if (c < L'0' || c > L'9')
+                return std::nullopt;
+            value = value * 10 + ULONGLONG(c - L'0');
+            if (value > std::numeric_limits<DWORD>::max())
+                return std::nullopt;
+        }
+        return DWORD(value);
+    };
+
+    InstanceId ret;
+    auto sep = str.find(L':');
+    auto pid = parseNumber(str.substr(0, sep));
+    if (!pid)
+        return std::nullopt;
+    ret.pid = *pid;
+    if (sep != str.npos) {
+        ret.leaseId = parseNumber(str.substr(sep + 1));
+        if (!ret.leaseId)
+            return std::nullopt;
+    }
+    return ret;
+}
+
+static std::wstring formatInstanceId(DWORD pid, std::optional<DWORD> leaseId) {
+    if (leaseId)
+        return std::format(L"{}:{}", pid, *leaseId);
+    return std::to_wstring(pid);
+}
+
+// The registry unless asked to scan for processes
+static InstanceList findInstances(bool scan) {
+    TraceSpan span("enumerate instances");
+    auto registry = scan ? nullptr : InstanceRegistry::open();
+    return enumerateInstances(registry.get());
+}
+
+static InstanceList discoverInstances(const QueryLimits & limits, bool scan) {
+    auto ret = findInstances(scan);
+    
+    std::vector<InstanceEntry> entries;
+    entries.reserve(ret.entries.size());
+    queryInstances(g_instancePipes, ret, limits, [&](InstanceEntry && entry) {
+        entries.push_back(std::move(entry));
+    });
+    std::ranges::sort(entries, {}, [](const InstanceEntry & entry) { 
+        return std::pair(entry.pid, entry.leaseId.value_or(0)); 
+    });
+    ret.entries = std::move(entries);
+    ret.needsQuery = false;
+    return ret;
+}
+
+static void resolveUsers(AccountNameCache & accounts, const InstanceList & instances, const QueryLimits & limits) {
+    std::vector<PSID> sids;
+    sids.reserve(instances.entries.size());
+    for (auto & entry: instances.entries)
+        sids.push_back(entry.userSid);
+    accounts.resolve(sids, Deadline::after(limits.perInstance));
+}
+
+// Table of instances shown by list
+class InstanceTable : public TextTable {
+public:
+    explicit InstanceTable(bool useColor):
+        TextTable({
+            {makeWColor<KA_COLOR_PID>(useColor),        Align::right, 9},
+            {makeWColor<KA_COLOR_USER>(useColor),       Align::left, 16, true},
+            {makeWColor<KA_COLOR_SESSION>(useColor),    Align::right, 4},
+            {makeWColor<KA_COLOR_DURATION>(useColor),   Align::right, 16}
+        }, makeWColor<Color::normal>(useColor)) {
+
+        add({L"PID", L"USER", L"SESSION", L"REMAINING"});
+    }
+
+    // Number of rows excluding the header
+    size_t size() const 
+        { return rowCount() - 1; }
+};
+
+enum class ListFormat {
+    table,
+    json,
+    csv,
+    tsv
+};
+
+static std::optional<ListFormat> parseListFormat(std::wstring_view str) {
+    if (str == L"table") return ListFormat::table;
+    if (str == L"json")  return ListFormat::json;
+    if (str == L"csv")   return ListFormat::csv;
+    if (str == L"tsv")   return ListFormat::tsv;
+    return std::nullopt;
+}
+
+// Writes list entries in machine-readable formats one at a time, as they become known.
+//
+// Fields are raw values rather than formatted text: remaining time in ms (empty/null if there 
+// is no deadline) and deadline as ms since the Unix epoch. JSON output is an array of objects
+// that is complete once end() is called. CSV quotes fields as necessary, TSV replaces tabs 
+// and line breaks in fields with spaces.
+class InstanceRecordWriter {
+public:
+    explicit InstanceRecordWriter(ListFormat format):
+        m_format(format)
+    {}
+
+    void begin() {
+        if (m_format == ListFormat::json) {
+            wprint(stdout, L"[");
+        } else {
+            std::wstring line;
+            for (auto name: s_fields)
+                appendField(line, name);
+            writeLine(line);
+        }
+    }
+
+    void write(const InstanceEntry & entry, std::wstring_view user) {
+        auto & info = entry.info.value;
+        bool success = entry.info.status == QueryStatus::success;
+
+        std::optional<ULONGLONG> deadline;
+        if (success && info.deadline)
+            deadline = fileTimeToUnixMs(*info.deadline);
+        std::optional<ULONGLONG> remaining;
+        if (success && info.remainingMs != Duration::infinite)
+            remaining = info.remainingMs;
+        std::optional<ULONGLONG> age;
+        if (success)
+            age = info.ageMs;
+
+        std::wstring line;
+        appendField(line, entry.pid);
+        appendField(line, entry.leaseId);
+        appendField(line, user);
+        appendField(line, entry.userSid ? sidToString(entry.userSid) : std::wstring());
+        appendField(line, entry.sessionId);
+        appendField(line, describe(entry.info.status));
+        appendField(line, remaining);
+        appendField(line, deadline);
+        appendField(line, age);
+        if (m_format == ListFormat::json)
+            line += L'}';
+        writeLine(line);
+    }
+
+    void end() {
+        if (m_format == ListFormat::json)
+            wprint(stdout, m_count ? L"\n]\n" : L"]\n");
+        g_stdout.flush();
+    }
+
+private:
+    static std::wstring_view describe(QueryStatus status) {
+        switch(status) {
+            case QueryStatus::success:      return L"ok";
+            case QueryStatus::inaccessible: return L"inaccessible";
+            case QueryStatus::timedOut:     return L"timeout";
+            case QueryStatus::unavailable:  return L"unavailable";
+        }
+        return L"";
+    }
+
+    void writeLine(std::wstring & line) {
+        if (m_format == ListFormat::json)
+            line.insert(0, m_count ? L",\n" : L"\n");
+        else
+            line += L'\n';
+        ++m_count;
+        wprint(stdout, line);
+        //let consumers see each entry as soon as it is known
+        g_stdout.flush();
+    }
+
+    void startField(std::wstring & line) {
+        if (line.empty())
+            m_field = 0;
+        if (m_format == ListFormat::json) {
+            line += line.empty() ? L"{\"" : L", \"";
+            line += s_fields[m_field++];
+            line += L"\": ";
+        } else if (!line.empty()) {
+            line += m_format == ListFormat::csv ? L',' : L'\t';
+        }
+    }
+
+    void appendField(std::wstring & line, std::optional<ULONGLONG> value) {
+        startField(line);
+        if (value)
+            std::format_to(std::back_inserter(line), L"{}", *value);
+        else if (m_format == ListFormat::json)
+            line += L"null";
+    }
+
+    void appendField(std::wstring & line, std::optional<DWORD> value) {
+        appendField(line, value ? std::optional<ULONGLONG>(*value) : std::nullopt);
+    }
+
+    void appendField(std::wstring & line, DWORD value) {
+        appendField(line, std::optional<ULONGLONG>(value));
+    }
+
+    void appendField(std::wstring & line, std::wstring_view value) {
+        startField(line);
+        switch(m_format) {
+            case ListFormat::json:
+                line += L'"';
+                for (auto c: value) {
+                    switch(c) {
+                        case L'"':  line += L"\\\""; break;
+                        case L'\\': line += L"\\\\"; break;
+                        case L'\n': line += L"\\n"; break;
+                        case L'\r': line += L"\\r"; break;
+                        case L'\t': line += L"\\t"; break;
+                        default:
+                            if (c < L' ')
+                                std::format_to(std::back_inserter(line), L"\\u{:04x}", unsigned(c));
+                            else
+                                line += c;
+                    }
+                }
+                line += L'"';
+                break;
+            case ListFormat::csv:
+                if (value.find_first_of(L",\"\r\n") == value.npos) {
+                    line += value;
+                } else {
+                    line += L'"';
+                    for (auto c: value) {
+                        if (c == L'"')
+                            line += L'"';
+                        line += c;
+                    }
+                    line += L'"';
+                }
+                break;
+            default:
+                for (auto c: value)
+                    line += (c == L'\t' || c == L'\r' || c == L'\n') ? L' ' : c;
+        }
+    }
+
+private:
+    static constexpr std::wstring_view s_fields[] = {
+        L"pid", L"lease", L"user", L"sid", L"session", L"status", L"remaining_ms", L"deadline_ms", L"age_ms"
+    };
+
+    ListFormat m_format;
+    size_t m_field = 0;
+    size_t m_count = 0;
+};
+
+// Writes entries as each instance replies rather than after all of them did
+static void streamProcesses(const QueryLimits & limits, bool scan, ListFormat format) {
+    auto instances = findInstances(scan);
+    AccountNameCache accounts(accountCacheTtl());
+    resolveUsers(accounts, instances, limits);
+
+    InstanceRecordWriter writer(format);
+    writer.begin();
+    queryInstances(g_instancePipes, instances, limits, [&](InstanceEntry && entry) {
+        if (entry.info.status != QueryStatus::unavailable)
+            writer.write(entry, entry.userSid ? accounts.nameOf(entry.userSid) : std::wstring());
+    });
+    writer.end();
+}
+
+static std::wstring formatBytes(ULONGLONG bytes) {
+    if (bytes < 1024)
+        return std::format(L"{} B", bytes);
+    if (bytes < 1024 * 1024)
+        return std::format(L"{:.1f} KB", double(bytes) / 1024);
+    return std::format(L"{:.1f} MB", double(bytes) / (1024 * 1024));
+}
+
+static std::wstring_view describeRequestType(size_t type) {
+    switch(MessageType(type)) {
+        case MessageType::infoRequest:          return L"info";
+        case MessageType::stopRequest:          return L"stop";
+        case MessageType::acquireLeaseRequest:  return L"acquire lease";
+        case MessageType::listLeasesRequest:    return L"list leases";
+        case MessageType::releaseLeaseRequest:  return L"release lease";
+        case MessageType::statsRequest:         return L"stats";
+        case MessageType::setDeadlineRequest:   return L"set deadline";
+        default:                                return {};
+    }
+}
+
+// Queries runtime statistics of every listed instance and appends their table and totals to out
+static void appendStats(std::wstring & out, bool useColor, const InstanceList & instances, const QueryLimits & limits) {
+    std::vector<DWORD> pids;
+    for (auto & entry: instances.entries) {
+        if (entry.info.status == QueryStatus::success)
+            pids.push_back(entry.pid);
+    }
+    //leases of a broker are listed separately but it has only one set of statistics
+    auto dups = std::ranges::unique(pids);
+    pids.erase(dups.begin(), dups.end());
+
+    std::vector<std::optional<StatsReply>> replies(pids.size());
+    auto overall = Deadline::after(limits.total);
+    forEachParallel(pids.size(), [&](size_t idx) {
+        StatsReply reply;
+        if (queryStats(g_instancePipes, pids[idx], limits.deadlineFor(overall), reply) == ERROR_SUCCESS)
+            replies[idx] = reply;
+    });
+
+    TextTable table({
+        {makeWColor<KA_COLOR_PID>(useColor),        TextTable::Align::right, 9},
+        {{},                                        TextTable::Align::right, 11},
+        {{},                                        TextTable::Align::right, 8},
+        {{},                                        TextTable::Align::right, 9},
+        {{},                                        TextTable::Align::right, 7},
+        {{},                                        TextTable::Align::right, 9},
+        {{},                                        TextTable::Align::right, 9},
+        {{},                                        TextTable::Align::right, 7},
+        {makeWColor<KA_COLOR_DURATION>(useColor),   TextTable::Align::right, 16}
+    }, makeWColor<Color::normal>(useColor));
+    table.add({L"PID", L"CONNECTIONS", L"REQUESTS", L"MALFORMED", L"WAKEUPS", L"MEMORY", L"PRIVATE", L"HANDLES", L"AWAKE"});
+
+    auto total = makeMessage<StatsReply>();
+    size_t unsupported = 0;
+    for (size_t i = 0; i < pids.size(); ++i) {
+        if (!replies[i]) {
+            ++unsupported;
+            continue;
+        }
+        auto & reply = *replies[i];
+        auto requests = reply.legacyRequests;
+        for (size_t type = 0; type < g_statsRequestTypes; ++type) {
+            requests += reply.requests[type];
+            total.requests[type] += reply.requests[type];
+        }
+        for (size_t bucket = 0; bucket < g_statsLatencyBuckets; ++bucket)
+            total.latency[bucket] += reply.latency[bucket];
+        total.connections += reply.connections;
+        total.legacyRequests += reply.legacyRequests;
+        total.malformed += reply.malformed;
+        total.wakeups += reply.wakeups;
+        total.workingSet += reply.workingSet;
+        total.privateBytes += reply.privateBytes;
+        total.handles += reply.handles;
+        total.powerRequestMs += reply.powerRequestMs;
+
+        table.add({
+            std::to_wstring(pids[i]),
+            std::to_wstring(reply.connections),
+            std::to_wstring(requests),
+            std::to_wstring(reply.malformed),
+            std::to_wstring(reply.wakeups),
+            formatBytes(reply.workingSet),
+            formatBytes(reply.privateBytes),
+            std::to_wstring(reply.handles),
+            std::format(L"{}", Duration{reply.powerRequestMs})
+        });
+    }
+    if (table.rowCount() == 1) {
+        out += L"\nno instance reports statistics\n";
+        return;
+    }
+
+    auto totalRequests = total.legacyRequests;
+    for (auto count: total.requests)
+        totalRequests += count;
+    table.add({
+        L"total",
+        std::to_wstring(total.connections),
+        std::to_wstring(totalRequests),
+        std::to_wstring(total.malformed),
+        std::to_wstring(total.wakeups),
+        formatBytes(total.workingSet),
+        formatBytes(total.privateBytes),
+        std::to_wstring(total.handles),
+        std::format(L"{}", Duration{total.powerRequestMs})
+    });
+
+    out += L'\n';
+    table.render(out);
+
+    out += L"\nrequests:";
+    const wchar_t * sep = L" ";
+    for (size_t type = 0; type < g_statsRequestTypes; ++type) {
+        auto name = describeRequestType(type);
+        if (name.empty() || !total.requests[type])
+            continue;
+        std::format_to(std::back_inserter(out), L"{}{} {}", sep, name, total.requests[type]);
+        sep = L", ";
+    }
+    if (total.legacyRequests)
+        std::format_to(std::back_inserter(out), L"{}legacy {}", sep, total.legacyRequests);
+    else if (!totalRequests)
+        out += L" none";
+    out += L'\n';
+
+    out += L"latency:";
+    for (size_t bucket = 0; bucket < g_statsLatencyBuckets; ++bucket) {
+        auto bound = bucket < std::size(g_statsLatencyBoundsUs) ? g_statsLatencyBoundsUs[bucket] : g_statsLatencyBoundsUs[bucket - 1];
+        std::format_to(std::back_inserter(out), L"{}{}{}{} {}", 
+                       bucket ? L", " : L" ",
+                       bucket < std::size(g_statsLatencyBoundsUs) ? L"<" : L">=",
+                       bound < 1'000 ? bound : bound / 1'000,
+                       bound < 1'000 ? L"us" : L"ms",
+                       total.latency[bucket]);
+    }
+    out += L'\n';
+
+    if (unsupported)
+        std::format_to(std::back_inserter(out), L"{} instance(s) did not report statistics (started by an older version or did not respond)\n", unsupported);
+}
+
+static void listProcesses(ColorStatus envColorStatus, const QueryLimits & limits, bool scan, bool stats) {
+    auto startTime = std::chrono::steady_clock::now();
+
+    auto instances = discoverInstances(limits, scan);
+    AccountNameCache accounts(accountCacheTtl());
+    resolveUsers(accounts, instances, limits);
+
+    auto useColor = shouldUseColor(envColorStatus, stdout);
+    InstanceTable table(useColor);
+
+    size_t timedOut = 0;
+    for(auto & entry: instances.entries) {
+        std::wstring remaining;
+        switch(entry.info.status) {
+            case QueryStatus::success:      remaining = std::format(L"{}", Duration{entry.info.value.remainingMs}); break;
+            case QueryStatus::inaccessible: remaining = L"<inaccessible>"; break;
+            case QueryStatus::timedOut:     remaining = L"<timeout>"; ++timedOut; break;
+            case QueryStatus::unavailable:  continue;
+        }
+        table.add({
+            formatInstanceId(entry.pid, entry.leaseId), 
+            accounts.nameOf(entry.userSid), 
+            std::to_wstring(entry.sessionId), 
+            remaining});
+    }
+
+    std::wstring out;
+    table.render(out);
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime);
+    std::format_to(std::back_inserter(out), L"\nlisted {} instance(s) in {} ms", table.size(), elapsed.count());
+    if (timedOut)
+        std::format_to(std::back_inserter(out), L", {0}{2} timed out{1}", makeWColor<KA_COLOR_ERROR>(useColor), makeWColor<Color::normal>(useColor), timedOut);
+    out += L'\n';
+    if (stats)
+        appendStats(out, useColor, instances, limits);
+    wprint(stdout, out);
+    g_stdout.flush();
+}
+
+// Histogram in Prometheus/OpenMetrics text exposition format with fixed bucket bounds.
+// Observations accumulate over the lifetime of the object as the format requires.
+class MetricHistogram {
+public:
+    MetricHistogram(std::initializer_list<double> bounds):
+        m_bounds(bounds),
+        m_counts(bounds.size() + 1)
+    {}
+
+    void observe(double value) {
+        auto bucket = size_t(std::ranges::lower_bound(m_bounds, value) - m_bounds.begin());
+        ++m_counts[bucket];
+        m_sum += value;
+    }
+
+    void write(std::string & out, std::string_view name, std::string_view help) const {
+        std::format_to(std::back_inserter(out), "# HELP {0} {1}\n# TYPE {0} histogram\n", name, help);
+        ULONGLONG cumulative = 0;
+        for (size_t i = 0; i < m_bounds.size(); ++i) {
+            cumulative += m_counts[i];
+            std::format_to(std::back_inserter(out), "{}_bucket{{le=\"{}\"}} {}\n", name, formatBound(m_bounds[i]), cumulative);
+        }
+        cumulative += m_counts.back();
+        std::format_to(std::back_inserter(out), "{0}_bucket{{le=\"+Inf\"}} {1}\n{0}_sum {2}\n{0}_count {1}\n", name, cumulative, m_sum);
+    }
+
+private:
+    // OpenMetrics expects bounds as canonical floats: 1.0 rather than 1 and 0.0001 rather than 1e-04
+    static std::string formatBound(double bound) {
+        char buf[64];
+        auto res = std::to_chars(buf, buf + sizeof(buf), bound, std::chars_format::fixed);
+        std::string ret(buf, res.ptr);
+        if (ret.find('.') == ret.npos)
+            ret += ".0";
+        return ret;
+    }
+
+private:
+    std::vector<double> m_bounds;
+    std::vector<ULONGLONG> m_counts;
+    double m_sum = 0;
+};
+
+// Writes the state of all instances as OpenMetrics text suitable for node-exporter textfile collector.
+//
+// Discovery is the same as for list (registry unless scan is requested, bounded by limits) but 
+// every instance found is then queried over its pipe so that its responsiveness is measured. 
+// The file is written to a temporary one next to it and renamed over it so collectors never 
+// see a partial file. With interval, keeps refreshing the file until interrupted and the 
+// histograms accumulate across refreshes.
+class MetricsExporter {
+public:
+    MetricsExporter(std::wstring path, const QueryLimits & limits, bool scan):
+        m_path(std::move(path)),
+        m_limits(limits),
+        m_scan(scan),
+        m_accounts(accountCacheTtl())
+    {}
+
+    void run(std::optional<ULONGLONG> interval) {
+        for ( ; ; ) {
+            auto next = Deadline::after(interval.value_or(0));
+            write(collect());
+            if (!interval)
+                break;
+            Sleep(next.remaining());
+        }
+    }
+
+private:
+    std::string collect() {
+        auto startTime = std::chrono::steady_clock::now();
+
+        auto instances = findInstances(m_scan);
+        resolveUsers(m_accounts, instances, m_limits);
+        //Query every instance, even ones the registry describes, so that query latency and unresponsive 
+        //instances are actually measured
+        instances.needsQuery = true;
+
+        //samples of each metric family have to be kept together
+        std::string remaining, deadlines;
+        size_t active = 0, unresponsive = 0;
+        std::set<DWORD> queried;
+        queryInstances(g_instancePipes, instances, m_limits, [&](InstanceEntry && entry) {
+            if (entry.queryUs && queried.insert(entry.pid).second)
+                m_queryLatency.observe(double(*entry.queryUs) / 1'000'000);
+
+            if (entry.info.status == QueryStatus::unavailable)
+                return;
+            if (entry.info.status != QueryStatus::success) {
+                ++unresponsive;
+                return;
+            }
+            ++active;
+            auto labels = std::format("pid=\"{}\",lease=\"{}\",user=\"{}\",session=\"{}\"", 
+                                      entry.pid, 
+                                      entry.leaseId ? std::to_string(*entry.leaseId) : std::string(), 
+                                      escapeLabel(entry.userSid ? narrow(m_accounts.nameOf(entry.userSid)) : std::string()),
+                                      entry.sessionId);
+            auto & info = entry.info.value;
+            if (info.remainingMs == Duration::infinite)
+                std::format_to(std::back_inserter(remaining), "keep_awake_remaining_seconds{{{}}} +Inf\n", labels);
+            else
+                std::format_to(std::back_inserter(remaining), "keep_awake_remaining_seconds{{{}}} {}\n", labels, double(info.remainingMs) / 1'000);
+            if (info.deadline)
+                std::format_to(std::back_inserter(deadlines), "keep_awake_deadline_timestamp_seconds{{{}}} {}\n", labels, double(fileTimeToUnixMs(*info.deadline)) / 1'000);
+        });
+
+        m_discoveryLatency.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count());
+
+        std::string out;
+        out += "# HELP keep_awake_instances Number of active instances and leases.\n"
+               "# TYPE keep_awake_instances gauge\n";
+        std::format_to(std::back_inserter(out), "keep_awake_instances {}\n", active);
+        out += "# HELP keep_awake_unresponsive_instances Number of instances that could not be queried in time or are inaccessible.\n"
+               "# TYPE keep_awake_unresponsive_instances gauge\n";
+        std::format_to(std::back_inserter(out), "keep_awake_unresponsive_instances {}\n", unresponsive);
+        out += "# HELP keep_awake_remaining_seconds Time left until an instance or lease expires.\n"
+               "# TYPE keep_awake_remaining_seconds gauge\n";
+        out += remaining;
+        out += "# HELP keep_awake_deadline_timestamp_seconds Time when an instance or lease expires, in seconds since Unix epoch.\n"
+               "# TYPE keep_awake_deadline_timestamp_seconds gauge\n";
+        out += deadlines;
+        m_discoveryLatency.write(out, "keep_awake_discovery_duration_seconds", "Time it took to find and query all instances.");
+        m_queryLatency.write(out, "keep_awake_query_duration_seconds", "Time it took to query an individual instance.");
+        out += "# EOF\n";
+        return out;
+    }
+
+    void write(const std::string & content) {
+        auto tempPath = std::format(L"{}.{}.tmp", m_path, GetCurrentProcessId());
+        {
+            AutoFile file = CreateFileW(tempPath.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 
+                                        FILE_ATTRIBUTE_NORMAL | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED, nullptr);
+            if (!file)
+                throwLastError("CreateFile");
+            DWORD written;
+            if (!WriteFile(file.get(), content.data(), DWORD(content.size()), &written, nullptr)) {
+                auto err = GetLastError();
+                file.reset();
+                DeleteFileW(tempPath.c_str());
+                throwWin32Error(err, "WriteFile");
+            }
+        }
+        if (!MoveFileExW(tempPath.c_str(), m_path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            auto err = GetLastError();
+            DeleteFileW(tempPath.c_str());
+            throwWin32Error(err, "MoveFileEx");
+        }
+    }
+
+    static std::string escapeLabel(std::string_view value) {
+        std::string ret;
+        ret.reserve(value.size());
+        for (auto c: value) {
+            switch(c) {
+                case '"':  ret += "\\\""; break;
+                case '\\': ret += "\\\\"; break;
+                case '\n': ret += "\\n"; break;
+                default:   ret += c;
+            }
+        }
+        return ret;
+    }
+
+private:
+    std::wstring m_path;
+    QueryLimits m_limits;
+    bool m_scan;
+    AccountNameCache m_accounts;
+    MetricHistogram m_discoveryLatency{0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10};
+    MetricHistogram m_queryLatency{0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 2};
+};
+
+// How often watch re-validates the registry even without change notifications.
+// This catches instances that crashed without unregistering and missed notifications.
+constexpr ULONGLONG g_watchRecheckInterval = 5'000;
+
+enum class InstanceEvent {
+    running,    //already running when watch started
+    created,
+    extended,
+    shortened,
+    stopped,
+    expired
+};
+
+static std::wstring_view describe(InstanceEvent event) {
+    switch(event) {
+        case InstanceEvent::running:    return L"running";
+        case InstanceEvent::created:    return L"created";
+        case InstanceEvent::extended:   return L"extended";
+        case InstanceEvent::shortened:  return L"shortened";
+        case InstanceEvent::stopped:    return L"stopped";
+        case InstanceEvent::expired:    return L"expired";
+    }
+    return L"";
+}
+
+using RegistrySnapshot = std::map<DWORD, RegistryRecord>;
+
+// Calls proc(event, record) for every difference between two registry snapshots
+static void diffSnapshots(const RegistrySnapshot & before, const RegistrySnapshot & after, ULONGLONG now, auto && proc) {
+    //instances are considered expired if they exit around their deadline
+    constexpr ULONGLONG expirySlack = 1'000;
+
+    auto ended = [&](const RegistryRecord & record) {
+        proc(record.deadlineTick <= now + expirySlack ? InstanceEvent::expired : InstanceEvent::stopped, record);
+    };
+
+    for (auto & [pid, record]: after) {
+        auto it = before.find(pid);
+        if (it == before.end() || it->second.creationTime != record.creationTime) {
+            if (it != before.end())
+                ended(it->second);
+            proc(InstanceEvent::created, record);
+        } else if (record.deadlineTick > it->second.deadlineTick) {
+            proc(InstanceEvent::extended, record);
+        } else if (record.deadlineTick < it->second.deadlineTick) {
+            proc(InstanceEvent::shortened, record);
+        }
+    }
+    for (auto & [pid, record]: before) {
+        if (!after.contains(pid))
+            ended(record);
+    }
+}
+
+// Time until the displayed remaining time of any instance changes
+static ULONGLONG untilDisplayChange(const RegistrySnapshot & snapshot, ULONGLONG now) {
+    auto ret = std::numeric_limits<ULONGLONG>::max();
+    for (auto & [pid, record]: snapshot) {
+        if (record.deadlineTick == g_infiniteTick || record.deadlineTick <= now)
+            continue;
+        //remaining time is displayed rounded to seconds
+        auto left = record.deadlineTick - now;
+        ret = std::min(ret, left >= 500 ? (left - 500) % 1000 + 1 : left + 1);
+    }
+    return ret;
+}
+
+static bool enableVirtualTerminal(FILE * fp) {
+    auto handle = HANDLE(_get_osfhandle(_fileno(fp)));
+    DWORD mode;
+    if (!GetConsoleMode(handle, &mode))
+        return false;
+    return (mode & ENABLE_VIRTUAL_TERMINAL_PROCESSING) || 
+            SetConsoleMode(handle, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+}
+
+// Keeps a block of lines at the bottom of the console up to date, rewriting only the lines that changed
+class Dashboard {
+public:
+    void show(const std::vector<std::wstring> & lines, unsigned width) {
+        std::wstring out;
+        if (lines.size() != m_lines.size() || width != m_width) {
+            if (!m_lines.empty())
+                out += std::format(L"\x1b[{}F\x1b[0J", m_lines.size());
+            for (auto & line: lines) {
+                out += line;
+                out += L'\n';
+            }
+        } else {
+            for (size_t i = 0; i < lines.size(); ++i) {
+                if (lines[i] == m_lines[i])
+                    continue;
+                auto up = lines.size() - i;
+                out += std::format(L"\x1b[{0}F\x1b[2K{1}\x1b[{0}E", up, lines[i]);
+            }
+        }
+        if (!out.empty()) {
+            wprint(stdout, out);
+            g_stdout.flush();
+        }
+        m_lines = lines;
+        m_width = width;
+    }
+private:
+    std::vector<std::wstring> m_lines;
+    unsigned m_width = 0;
+};
+
+// Shows running instances and keeps the display updated as they change.
+// Changes are discovered via registry notifications and remaining times are interpolated 
+// locally in between so nothing is re-queried or re-enumerated while nothing happens.
+// If the output is not a console, lifecycle events are printed one per line instead.
+[[noreturn]]
+static void watchProcesses(ColorStatus envColorStatus, const QueryLimits & limits) {
+    auto registry = InstanceRegistry::open();
+    if (!registry)
+        throw std::runtime_error("instance registry is not available, --watch cannot be used");
+
+    AccountNameCache accounts(accountCacheTtl());
+    auto useColor = shouldUseColor(envColorStatus, stdout);
+    auto dashboard = enableVirtualTerminal(stdout) ? std::make_optional<Dashboard>() : std::nullopt;
+
+    auto userOf = [](const RegistryRecord & record) {
+        return IsValidSid(PSID(record.userSid)) ? PSID(record.userSid) : nullptr;
+    };
+
+    RegistrySnapshot current;
+    bool initial = true;
+    auto generation = std::numeric_limits<ULONGLONG>::max();
+    ULONGLONG nextRecheck = 0;
+    std::wstring lastEvent;
+    
+    while (true) {
+        auto now = GetTickCount64();
+        registry->resetChangeEvent();
+        if (auto latestGeneration = registry->generation(); latestGeneration != generation || now >= nextRecheck) {
+            generation = latestGeneration;
+            nextRecheck = now + g_watchRecheckInterval;
+
+            RegistrySnapshot latest;
+            std::vector<PSID> sids;
+            registry->forEachLive([&](const RegistryRecord & record) {
+                latest.emplace(record.pid, record);
+            });
+            for (auto & [pid, record]: latest)
+                sids.push_back(userOf(record));
+            accounts.resolve(sids, Deadline::after(limits.perInstance));
+
+            diffSnapshots(current, latest, now, [&](InstanceEvent event, const RegistryRecord & record) {
+                if (initial)
+                    event = InstanceEvent::running;
+                SYSTEMTIME time;
+                GetLocalTime(&time);
+                lastEvent = std::format(L"{:02}:{:02}:{:02} {}{}{} {}", time.wHour, time.wMinute, time.wSecond, 
+                                        makeWColor<KA_COLOR_PID>(useColor), record.pid, makeWColor<Color::normal>(useColor),
+                                        describe(event));
+                if (!dashboard) {
+                    wprint(stdout, L"{}, {}{}{}, session {}{}{}, remaining {}{}{}\n", lastEvent,
+                           makeWColor<KA_COLOR_USER>(useColor), accounts.nameOf(userOf(record)), makeWColor<Color::normal>(useColor),
+                           makeWColor<KA_COLOR_SESSION>(useColor), record.sessionId, makeWColor<Color::normal>(useColor),
+                           makeWColor<KA_COLOR_DURATION>(useColor), remainingUntil(record.deadlineTick, now), makeWColor<Color::normal>(useColor));
+                }
+            });
+            if (!dashboard)
+                g_stdout.flush();
+            current = std::move(latest);
+            initial = false;
+        }
+
+        auto wait = nextRecheck - now;
+        if (dashboard) {
+            InstanceTable table(useColor);
+            for (auto & [pid, record]: current) {
+                table.add({
+                    std::to_wstring(pid),
+                    accounts.nameOf(userOf(record)),
+                    std::to_wstring(record.sessionId),
+                    std::format(L"{}", remainingUntil(record.deadlineTick, now))
+                });
+            }
+            //avoid ever wrapping lines since this breaks cursor positioning
+            auto width = std::max(unsigned(terminalWidth(stdout)), 40u);
+            auto lines = table.renderLines(width - 1);
+            lines.emplace_back();
+            lines.push_back(std::format(L"watching {} instance(s){}{}", table.size(), lastEvent.empty() ? L"" : L", last event: ", lastEvent));
+            dashboard->show(lines, width);
+
+            wait = std::min(wait, untilDisplayChange(current, now));
+        }
+
+        if (auto event = registry->changeEvent())
+            WaitForSingleObject(event, DWORD(wait));
+        else
+            Sleep(DWORD(wait));
+    }
+}
+
+struct StopOptions {
+    std::vector<InstanceId> ids;
+    bool all = false;
+    std::optional<std::wstring> user;
+    std::optional<DWORD> session;
+    std::optional<ULONGLONG> olderThan;
+    bool wait = false;
+
+    bool selectsInstances() const 
+        { return all || user || session || olderThan; }
+};
+
+enum class StopOutcome {
+    sent,           //stop request delivered, exit not awaited
+    exited,
+    released,       //lease released
+    stillRunning,   //did not exit before the deadline
+    failed
+};
+
+struct StopResult {
+    InstanceId id;
+    StopOutcome outcome = StopOutcome::failed;
+    DWORD error = ERROR_SUCCESS;
+};
+
+// SID of the account given as user name (with or without domain) or in S-1-... form
+static std::vector<BYTE> lookupUser(const std::wstring & user) {
+    unqiue_local_membuf<SID> psid;
+    if (ConvertStringSidToSidW(user.c_str(), std::out_ptr<PSID>(psid))) {
+        auto bytes = reinterpret_cast<const BYTE *>(psid.get());
+        return std::vector<BYTE>(bytes, bytes + GetLengthSid(psid.get()));
+    }
+
+    std::vector<BYTE> sid(SECURITY_MAX_SID_SIZE);
+    std::wstring domain(256, L'\0');
+    for ( ; ; ) {
+        auto sidSize = DWORD(sid.size());
+        auto domainSize = DWORD(domain.size());
+        SID_NAME_USE use;
+        if (LookupAccountNameW(nullptr, user.c_str(), sid.data(), &sidSize, domain.data(), &domainSize, &use)) {
+            sid.resize(sidSize);
+            return sid;
         }
+        auto err = GetLastError();
+        if (err == ERROR_NONE_MAPPED)
+            throw std::runtime_error(std::format("unknown user {}", narrow(user)));
+        if (err != ERROR_INSUFFICIENT_BUFFER)
+            throwWin32Error(err, "LookupAccountName");
+        sid.resize(std::max(size_t(sidSize), sid.size()));
+        domain.resize(std::max(size_t(domainSize), domain.size() + 1));
     }
 }
 
-static std::optional<std::wstring> getInfo(DWORD procId) {
-    std::optional<std::string> result;
-    auto err = execOnPipe(procId, "info", [&result](HANDLE hPipe) -> DWORD {
-        result = readPipeMessage(hPipe, 256);
-        if (!result)
-            return GetLastError();
-        return ERROR_SUCCESS;
-    }); 
-    if (err == ERROR_SUCCESS && result)
-        return widen(*result);
-    if (err == ERROR_ACCESS_DENIED)
-        return L"<inaccessible>";
-    return {};
+static bool matchesUser(PSID userSid, const std::vector<BYTE> & user) {
+    return userSid && IsValidSid(userSid) && EqualSid(userSid, PSID(user.data()));
 }
 
-static bool kill(DWORD procId) {
-    return execOnPipe(procId, "stop", [] (HANDLE) {}) == ERROR_SUCCESS;
+static std::wstring_view describeInstanceError(DWORD err) {
+    switch(err) {
+        case ERROR_TIMEOUT:         return L" (timed out)";
+        case ERROR_ACCESS_DENIED:   return L" (access denied)";
+        case ERROR_FILE_NOT_FOUND:  return L" (no such instance)";
+        case ERROR_NOT_FOUND:       return L" (no such lease)";
+        case ERROR_NOT_SUPPORTED:   return L" (not supported by this instance)";
+        default:                    return L"";
+    }
 }
 
-static std::wstring sidToUsername(PSID psid) {
-
-    if (!psid)
-        return L"<unknown>";
-
-    std::wstring name, domain;
+// Instances given explicitly or matching the filters in options
+static std::vector<InstanceId> selectInstances(const StopOptions & options, const QueryLimits & limits, bool scan) {
+    if (!options.selectsInstances())
+        return options.ids;
 
-    while (true) {
-        DWORD nameSize = DWORD(name.size()), domainSize = DWORD(domain.size());
-        SID_NAME_USE use;
-        if (LookupAccountSidW(nullptr, psid, name.data(), &nameSize, domain.data(), &domainSize, &use)) {
-            name.resize(wcslen(name.c_str()));
-            domain.resize(wcslen(domain.c_str()));
-            break;
-        }
-        auto err = GetLastError();
-        if (err != ERROR_INSUFFICIENT_BUFFER) {
-            unqiue_local_membuf<wchar_t> stringSid;
-            if (!ConvertSidToStringSidW(psid, std::out_ptr(stringSid)))
-                return L"<unknown>";
-            return stringSid.get();
-        }
-        name.resize(nameSize);
-        domain.resize(domainSize);
+    //resolved before looking for instances so that an unknown user fails fast
+    auto user = options.user ? lookupUser(*options.user) : std::vector<BYTE>{};
+    std::vector<InstanceId> ret;
+    auto instances = discoverInstances(limits, scan);
+    for (auto & entry: instances.entries) {
+        if (entry.info.status == QueryStatus::unavailable)
+            continue;
+        if (options.session && entry.sessionId != *options.session)
+            continue;
+        if (options.olderThan && (!entry.info.value.ageMs || *entry.info.value.ageMs < *options.olderThan))
+            continue;
+        if (options.user && !matchesUser(entry.userSid, user))
+            continue;
+        ret.push_back({entry.pid, entry.leaseId});
     }
-    return domain + L'\\' + name;
+    return ret;
 }
 
-static void listProcesses(ColorStatus envColorStatus) {
-    std::unique_ptr<WTS_PROCESS_INFO[], WTSDeleter> pi;
-    DWORD count;
-    if (!WTSEnumerateProcesses(WTS_CURRENT_SERVER_HANDLE, 0, 1, std::out_ptr(pi), &count))
-        throwLastError("WTSEnumerateProcesses");
+static bool stopProcesses(ColorStatus envColorStatus, const StopOptions & options, const QueryLimits & limits, bool scan) {
+    
+    std::vector<StopResult> results;
+    for (auto & id: selectInstances(options, limits, scan))
+        results.emplace_back().id = id;
 
-    size_t widths[4] = {9, 16, 4, 16};
-    enum Align {
-        left,
-        right
-    } aligns[std::size(widths)] = {right, left, right, right};
-    using Row = std::array<std::wstring, std::size(widths)>;
-    std::vector<Row> table;
+    auto overall = Deadline::after(limits.total);
+    forEachParallel(results.size(), [&](size_t idx) {
+        auto & result = results[idx];
 
-    auto addRow = [&](Row && row) {
-        for(size_t i = 0; i < row.size(); ++i) {
-            widths[i] = std::max(widths[i], size_t(stringWidth(row[i])));
+        if (result.id.leaseId) {
+            result.error = releaseLease(g_instancePipes, result.id.pid, *result.id.leaseId, limits.deadlineFor(overall));
+            result.outcome = result.error == ERROR_SUCCESS ? StopOutcome::released : StopOutcome::failed;
+            return;
         }
-        table.push_back(std::move(row));
-    };
 
-    auto useColor = shouldUseColor(envColorStatus, stdout);
-    
+        //Open the process before asking it to stop so we wait for the right one even if its pid is reused
+        AutoHandle process;
+        if (options.wait)
+            process = OpenProcess(SYNCHRONIZE, false, result.id.pid);
 
-    addRow({
-        colorize<KA_COLOR_PID>(useColor, L"PID"), 
-        colorize<KA_COLOR_USER>(useColor, L"USER"), 
-        colorize<KA_COLOR_SESSION>(useColor, L"SESSION"), 
-        colorize<KA_COLOR_DURATION>(useColor, L"REMAINING")
+        result.error = kill(result.id.pid, limits.deadlineFor(overall));
+        if (result.error != ERROR_SUCCESS) {
+            result.outcome = StopOutcome::failed;
+        } else if (!process) {
+            result.outcome = StopOutcome::sent;
+        } else if (WaitForSingleObject(process.get(), overall.remaining()) == WAIT_OBJECT_0) {
+            result.outcome = StopOutcome::exited;
+        } else {
+            result.outcome = StopOutcome::stillRunning;
+        }
     });
-    auto mypid = GetCurrentProcessId();
-    for(DWORD i = 0; i < count; ++i) {
-        auto & info = pi[i];
-        if (info.ProcessId == mypid)
-            continue;
-        if (info.pProcessName == L"keep-awake.exe"sv) {
-            if (auto remaining = getInfo(info.ProcessId)) {
-                addRow({
-                    colorize<KA_COLOR_PID>(useColor, std::to_wstring(info.ProcessId)), 
-                    colorize<KA_COLOR_USER>(useColor, sidToUsername(info.pUserSid)), 
-                    colorize<KA_COLOR_SESSION>(useColor, std::to_wstring(info.SessionId)), 
-                    colorize<KA_COLOR_DURATION>(useColor, *remaining)});
-            }
+
+    auto useColor = shouldUseColor(envColorStatus, stdout);
+    bool success = true;
+    for (auto & result: results) {
+        auto what = result.id.leaseId ? L"lease" : L"process";
+        auto id = formatInstanceId(result.id.pid, result.id.leaseId);
+        switch(result.outcome) {
+            case StopOutcome::sent:
+                wprint(stdout, L"{0}stop request successfully sent to process{1} {2}{3}{1}\n",
+                    makeWColor<KA_COLOR_SUCCESS>(useColor),
+                    makeWColor<Color::normal>(useColor),
+                    makeWColor<KA_COLOR_PID>(useColor),
+                    id);
+                break;
+            case StopOutcome::exited:
+                wprint(stdout, L"{0}process{1} {2}{3}{1} {0}stopped{1}\n",
+                    makeWColor<KA_COLOR_SUCCESS>(useColor),
+                    makeWColor<Color::normal>(useColor),
+                    makeWColor<KA_COLOR_PID>(useColor),
+                    id);
+                break;
+            case StopOutcome::released:
+                wprint(stdout, L"{0}lease{1} {2}{3}{1} {0}released{1}\n",
+                    makeWColor<KA_COLOR_SUCCESS>(useColor),
+                    makeWColor<Color::normal>(useColor),
+                    makeWColor<KA_COLOR_PID>(useColor),
+                    id);
+                break;
+            case StopOutcome::stillRunning:
+                wprint(stdout, L"{0}stop request sent to process{1} {2}{3}{1} {0}but it did not exit in time{1}\n",
+                    makeWColor<KA_COLOR_ERROR>(useColor),
+                    makeWColor<Color::normal>(useColor),
+                    makeWColor<KA_COLOR_PID>(useColor),
+                    id);
+                success = false;
+                break;
+            case StopOutcome::failed:
+                wprint(stdout, L"{0}unable to stop {5}{1} {2}{3}{1}{0}{4}{1}\n",
+                    makeWColor<KA_COLOR_ERROR>(useColor),
+                    makeWColor<Color::normal>(useColor),
+                    makeWColor<KA_COLOR_PID>(useColor),
+                    id,
+                    describeInstanceError(result.error),
+                    what);
+                success = false;
+                break;
         }
     }
+    if (results.empty())
+        wprint(stdout, L"no matching instances found\n");
+    g_stdout.flush();
+    return success;
+}
 
-    for (auto & row: table) {
-        std::wstring acc;
-        for(size_t i = 0; i < row.size(); ++i) {
-            std::wstring padding(widths[i] - stringWidth(row[i]), L' ');
-            if (aligns[i] == left)
-                acc += row[i] + padding;
-            else
-                acc += padding + row[i];
-            acc += L"  ";
+// Extends or shortens all selected instances in place, in parallel
+static bool changeDeadlines(ColorStatus envColorStatus, DeadlineChange change, ULONGLONG durationMs, 
+                            const StopOptions & options, const QueryLimits & limits, bool scan) {
+    struct Result {
+        InstanceId id;
+        DWORD error = ERROR_SUCCESS;
+        InfoReply info{};
+    };
+
+    std::vector<Result> results;
+    for (auto & id: selectInstances(options, limits, scan))
+        results.emplace_back().id = id;
+
+    auto overall = Deadline::after(limits.total);
+    forEachParallel(results.size(), [&](size_t idx) {
+        auto & result = results[idx];
+        result.error = setDeadline(g_instancePipes, result.id.pid, result.id.leaseId, change, durationMs, limits.deadlineFor(overall), result.info);
+    });
+
+    auto useColor = shouldUseColor(envColorStatus, stdout);
+    bool success = true;
+    for (auto & result: results) {
+        auto what = result.id.leaseId ? L"lease" : L"process";
+        auto id = formatInstanceId(result.id.pid, result.id.leaseId);
+        if (result.error != ERROR_SUCCESS) {
+            wprint(stdout, L"{0}unable to change deadline of {5}{1} {2}{3}{1}{0}{4}{1}\n",
+                makeWColor<KA_COLOR_ERROR>(useColor),
+                makeWColor<Color::normal>(useColor),
+                makeWColor<KA_COLOR_PID>(useColor),
+                id,
+                describeInstanceError(result.error),
+                what);
+            success = false;
+            continue;
         }
-        if (!acc.empty())
-            acc.resize(acc.size() - 2);
-        acc += L'\n';
-        wprint(stdout, acc);
+        auto remaining = result.info.remainingMs == g_protocolInfinite ? Duration::infinite : result.info.remainingMs;
+        wprint(stdout, L"{0}{5}{1} {2}{3}{1} {0}now has{1} {4}{6}{1} {0}remaining{1}\n",
+            makeWColor<KA_COLOR_SUCCESS>(useColor),
+            makeWColor<Color::normal>(useColor),
+            makeWColor<KA_COLOR_PID>(useColor),
+            id,
+            makeWColor<KA_COLOR_DURATION>(useColor),
+            what,
+            Duration{remaining});
     }
+    if (results.empty())
+        wprint(stdout, L"no matching instances found\n");
+    g_stdout.flush();
+    return success;
 }
 
 static void normalizeStdIO() noexcept {
@@ -759,22 +3673,75 @@ static std::wstring formatItemHelp(std::wstring_view name,
 static std::wstring usage(const wchar_t * progname, const Layout & layout, bool useColor) {
     std::wstring ret = colorize<KA_COLOR_HELP_HEADING>(useColor, L"Usage:\n");
     auto colprogname = colorize<KA_COLOR_HELP_PROGNAME>(useColor, progname);
-    ret += formatLine(std::format(L"{0} [{1}duration{2}]",
+    ret += formatLine(std::format(L"{0} [{3}--shared{2}] [{1}duration{2}]",
                                   colprogname,
                                   makeWColor<KA_COLOR_USAGE_ARG>(useColor),
-                                  makeWColor<Color::normal>(useColor)),
+                                  makeWColor<Color::normal>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_LONGOPT>(useColor)),
                       layout, layout.usageLeadingSpace);
-    ret += formatLine(std::format(L"{0} {1}list{2}",
+    ret += formatLine(std::format(L"{0} [{3}--shared{2}] {3}--until{2} {1}HH:MM{2}",
+                                  colprogname,
+                                  makeWColor<KA_COLOR_USAGE_ARG>(useColor),
+                                  makeWColor<Color::normal>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_LONGOPT>(useColor)),
+                      layout, layout.usageLeadingSpace);
+    ret += formatLine(std::format(L"{0} {3}--while-pid{2} {1}pid{2}|{3}--while-tree{2} {1}pid{2}|{3}--while-locked{2} {1}file{2} ... [{1}duration{2}]",
+                                  colprogname,
+                                  makeWColor<KA_COLOR_USAGE_ARG>(useColor),
+                                  makeWColor<Color::normal>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_LONGOPT>(useColor)),
+                      layout, layout.usageLeadingSpace);
+    ret += formatLine(std::format(L"{0} {1}list{2} [{3}--scan{2}] [{3}--stats{2}] [{3}--format{2} {4}table{2}|{4}json{2}|{4}csv{2}|{4}tsv{2}] [{3}--timeout{2} {4}duration{2}] [{3}--deadline{2} {4}duration{2}]",
                                   colprogname,
                                   makeWColor<KA_COLOR_USAGE_COMMAND>(useColor),
-                                  makeWColor<Color::normal>(useColor)),
+                                  makeWColor<Color::normal>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_LONGOPT>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_ARG>(useColor)),
                       layout, layout.usageLeadingSpace);
-    ret += formatLine(std::format(L"{0} {1}stop{2} {3}pid{2} [{3}pid{2} ...]",
+    ret += formatLine(std::format(L"{0} {1}list{2} {3}--watch{2} [{3}--timeout{2} {4}duration{2}]",
                                   colprogname,
                                   makeWColor<KA_COLOR_USAGE_COMMAND>(useColor),
                                   makeWColor<Color::normal>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_LONGOPT>(useColor),
                                   makeWColor<KA_COLOR_USAGE_ARG>(useColor)),
                       layout, layout.usageLeadingSpace);
+    ret += formatLine(std::format(L"{0} {1}stop{2} [{4}--wait{2}] [{4}--timeout{2} {3}duration{2}] [{4}--deadline{2} {3}duration{2}] {3}pid{2}[:{3}lease{2}] [{3}pid{2}[:{3}lease{2}] ...]",
+                                  colprogname,
+                                  makeWColor<KA_COLOR_USAGE_COMMAND>(useColor),
+                                  makeWColor<Color::normal>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_ARG>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_LONGOPT>(useColor)),
+                      layout, layout.usageLeadingSpace);
+    ret += formatLine(std::format(L"{0} {1}stop{2} [{4}--wait{2}] [{4}--timeout{2} {3}duration{2}] [{4}--deadline{2} {3}duration{2}] [{4}--scan{2}] "
+                                  L"[{4}--all{2}] [{4}--user{2} {3}name{2}] [{4}--session{2} {3}id{2}] [{4}--older-than{2} {3}duration{2}]",
+                                  colprogname,
+                                  makeWColor<KA_COLOR_USAGE_COMMAND>(useColor),
+                                  makeWColor<Color::normal>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_ARG>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_LONGOPT>(useColor)),
+                      layout, layout.usageLeadingSpace);
+    ret += formatLine(std::format(L"{0} {1}extend{2}|{1}set-remaining{2} [{4}--timeout{2} {3}duration{2}] [{4}--deadline{2} {3}duration{2}] {3}pid{2}[:{3}lease{2}] [{3}pid{2}[:{3}lease{2}] ...] {3}duration{2}",
+                                  colprogname,
+                                  makeWColor<KA_COLOR_USAGE_COMMAND>(useColor),
+                                  makeWColor<Color::normal>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_ARG>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_LONGOPT>(useColor)),
+                      layout, layout.usageLeadingSpace);
+    ret += formatLine(std::format(L"{0} {1}extend{2}|{1}set-remaining{2} [{4}--timeout{2} {3}duration{2}] [{4}--deadline{2} {3}duration{2}] [{4}--scan{2}] "
+                                  L"[{4}--all{2}] [{4}--user{2} {3}name{2}] [{4}--session{2} {3}id{2}] [{4}--older-than{2} {3}duration{2}] {3}duration{2}",
+                                  colprogname,
+                                  makeWColor<KA_COLOR_USAGE_COMMAND>(useColor),
+                                  makeWColor<Color::normal>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_ARG>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_LONGOPT>(useColor)),
+                      layout, layout.usageLeadingSpace);
+    ret += formatLine(std::format(L"{0} {1}metrics{2} [{4}--interval{2} {3}duration{2}] [{4}--scan{2}] [{4}--timeout{2} {3}duration{2}] [{4}--deadline{2} {3}duration{2}] {3}file{2}",
+                                  colprogname,
+                                  makeWColor<KA_COLOR_USAGE_COMMAND>(useColor),
+                                  makeWColor<Color::normal>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_ARG>(useColor),
+                                  makeWColor<KA_COLOR_USAGE_LONGOPT>(useColor)),
+                      layout, layout.usageLeadingSpace);
     ret += formatLine(std::format(L"{0} {1}--help{2}|{3}-h{2}",
                                   colprogname,
                                   makeWColor<KA_COLOR_USAGE_LONGOPT>(useColor),
@@ -804,8 +3771,8 @@ static std::wstring help(const wchar_t * argv0, const Layout & layout, bool useC
                           std::format(
                           L"how long to keep computer awake. If omitted, keep it awake indefinitely. "
                           L"The duration can be a simple number - this is interpreted as seconds. "
-                          L"Or, you can use a full format:\n{0}<num>d <num>h <num>m <num>[s]{1} "
-                          L"for days, hours, minutes and seconds. Every part is optional, but at least one must be present. "
+                          L"Or, you can use a full format:\n{0}<num>w <num>d <num>h <num>m <num>[s] <num>ms{1} "
+                          L"for weeks, days, hours, minutes, seconds and milliseconds. Every part is optional, but at least one must be present. "
                           L"You can use any number of spaces (including none) anywhere in the string but, if you do, you "
                           L"will need to wrap the string in \" to make it one command line argument.",
                               makeWColor<Color::bold>(useColor),
@@ -817,11 +3784,46 @@ static std::wstring help(const wchar_t * argv0, const Layout & layout, bool useC
     ret += formatItemHelp(colorize<KA_COLOR_HELP_COMMAND>(useColor, L"list"), 
                           L"show info about currently active keep-awake instances.",
                           maxNameLength, layout);
-    ret += formatItemHelp(std::format(L"{0}stop{1} {2}pid{1} [{2}pid{1} ...]",
+    ret += formatItemHelp(std::format(L"{0}stop{1} {2}pid{1}[:{2}lease{1}] ...",
+                                      makeWColor<KA_COLOR_HELP_COMMAND>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)),
+                          std::format(L"stop keep-awake instances given by {0}pid{1} arguments or release individual "
+                                      L"leases of a shared instance given by {0}pid{1}:{0}lease{1}. Alternatively, "
+                                      L"stop all instances matching {2}--all{1}, {2}--user{1}, {2}--session{1} and "
+                                      L"{2}--older-than{1} options. All instances are stopped in parallel.",
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor)),
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}extend{1} {2}pid{1} ... {2}duration{1}",
+                                      makeWColor<KA_COLOR_HELP_COMMAND>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)),
+                          std::format(L"add {0}duration{1} to the time remaining of running instances or leases without "
+                                      L"restarting them. Instances are selected the same way as for {2}stop{1} and "
+                                      L"changed in parallel. Instances without a deadline are not affected.",
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_COMMAND>(useColor)),
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}set-remaining{1} {2}pid{1} ... {2}duration{1}",
+                                      makeWColor<KA_COLOR_HELP_COMMAND>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)),
+                          std::format(L"make {0}duration{1} the time remaining of running instances or leases, "
+                                      L"extending or shortening them. This also sets a deadline for instances that "
+                                      L"had none.",
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor),
+                                      makeWColor<Color::normal>(useColor)),
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}metrics{1} {2}file{1}",
                                       makeWColor<KA_COLOR_HELP_COMMAND>(useColor),
                                       makeWColor<Color::normal>(useColor),
                                       makeWColor<KA_COLOR_HELP_ARG>(useColor)),
-                          std::format(L"stop keep-awake instances given by {0}pid{1} arguments.",
+                          std::format(L"write remaining time and deadline of every active instance together with "
+                                      L"discovery and query latency histograms to {0}file{1} in OpenMetrics text format "
+                                      L"for node-exporter textfile collector. The file is replaced atomically.",
                                       makeWColor<KA_COLOR_HELP_ARG>(useColor),
                                       makeWColor<Color::normal>(useColor)),
                           maxNameLength, layout);
@@ -839,6 +3841,141 @@ static std::wstring help(const wchar_t * argv0, const Layout & layout, bool useC
                                       makeWColor<Color::normal>(useColor)), 
                           L"report app version and exit.",
                           maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--until{1} {2}HH:MM{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"keep computer awake until the given local time (24-hour clock) instead of "
+                          L"for a duration. If the time has already passed today, it refers to tomorrow.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--clock{1} {2}monotonic|boot|wall{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"clock the duration is measured by. The default, boot, counts time the computer spends "
+                          L"asleep. monotonic does not, so the computer is kept awake for the full duration of "
+                          L"awake time. wall follows changes to the system time.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--shared{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor)), 
+                          L"take a lease from a single shared keep-awake instance for the current user instead of "
+                          L"starting a new one. The shared instance is started if it is not running and exits once "
+                          L"it holds no leases. A lease without a duration is held until released with stop.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--while-pid{1} {2}pid{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"keep computer awake while the process is running. Can be given multiple times and combined "
+                          L"with other --while options: the computer is kept awake while any of the conditions holds but "
+                          L"no longer than duration, if given.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--while-tree{1} {2}pid{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"keep computer awake while the process or any of its descendants, including ones it starts "
+                          L"later, is running.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--while-locked{1} {2}file{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"keep computer awake while another process holds a lock (LockFileEx) on the file. "
+                          L"The file must be locked when keep-awake starts.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--timeout{1} {2}duration{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"with list, stop or metrics: how long to wait for each instance to respond. "
+                          L"Uses the same format as duration argument. Default is 2 seconds.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--deadline{1} {2}duration{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"with list: how long to wait for all instances to respond. Instances that "
+                          L"did not respond in time are reported as <timeout>. With stop: how long to wait "
+                          L"for all instances to be stopped. With metrics: how long to wait for all instances "
+                          L"to respond in each refresh. Default is 10 seconds.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--scan{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor)), 
+                          L"with list, stop or metrics: find instances by enumerating all processes and querying each one "
+                          L"instead of reading the instance registry. This is slower but also finds instances "
+                          L"started by older versions of keep-awake.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--format{1} {2}format{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"with list: output format. One of table (default), json, csv or tsv. Machine-readable formats "
+                          L"contain raw values (remaining time in milliseconds, deadline in milliseconds since Unix epoch) "
+                          L"and print each instance as soon as it responds.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--stats{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor)), 
+                          L"with list: also show runtime statistics of each instance: connections accepted, requests "
+                          L"served, malformed requests, wakeups, memory, handles and how long it has kept the machine "
+                          L"awake, followed by totals and request latency histogram.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--interval{1} {2}duration{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"with metrics: keep refreshing the file every duration until interrupted with Ctrl+C "
+                          L"instead of writing it once. Histograms accumulate across refreshes.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--watch{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor)), 
+                          L"with list: keep showing instances and update the display as they are created, "
+                          L"extended, stopped or expire until interrupted with Ctrl+C. If the output is not a "
+                          L"console, print these events one per line instead.",
+                          maxNameLength, layout);
+#if KEEP_AWAKE_TRACING
+    ret += formatItemHelp(std::format(L"{0}--trace{1} {2}file{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"record how long each phase of the run takes in Chrome trace-event JSON format to file. "
+                          L"A background instance started by this run also records each request it serves.",
+                          maxNameLength, layout);
+#endif
+    ret += formatItemHelp(std::format(L"{0}--wait{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor)), 
+                          L"with stop: wait until instances actually exit rather than just sending them stop "
+                          L"requests. The wait is limited by --deadline.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--all{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor)), 
+                          L"with stop: stop all instances you have access to.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--user{1} {2}name{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"with stop: only stop instances run by the given user. The name can be given "
+                          L"with or without the domain part or as a SID.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--session{1} {2}id{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"with stop: only stop instances in the given session.",
+                          maxNameLength, layout);
+    ret += formatItemHelp(std::format(L"{0}--older-than{1} {2}duration{1}",
+                                      makeWColor<KA_COLOR_HELP_LONGOPT>(useColor),
+                                      makeWColor<Color::normal>(useColor),
+                                      makeWColor<KA_COLOR_HELP_ARG>(useColor)), 
+                          L"with stop: only stop instances that have been running for longer than duration.",
+                          maxNameLength, layout);
     ret += L"\n";
     ret += std::format(L"See {0}https://github.com/gershnik/keep-awake{1} for more details\n",
                        makeWColor<Color::bright_blue>(useColor),
@@ -854,29 +3991,175 @@ int wmain(int argc, wchar_t * argv[]) {
     const ColorStatus envColorStatus = environmentColorStatus();
 
     const auto myenv = _wgetenv(g_myGuid);
-    const bool isChild = myenv && myenv == L"ON"sv;
     const auto progname = argc ? argv[0] : L"keep-awake";
 
+    if (auto childSettings = myenv ? ChildSettings::decode(myenv) : std::nullopt) {
+        //We are the background instance: the launcher has already parsed and validated everything
+        LaunchReporter reporter(HANDLE(uintptr_t(childSettings->reportPipe)));
+        try {
+            if (auto tracePath = _wgetenv(traceEnvVarName().c_str())) {
+                //tracing must never stop us from working: if the file is gone or locked run untraced
+                try {
+                    Tracer::start(tracePath, false);
+                } catch (std::exception &) {
+                }
+            }
+            auto conditions = _wgetenv(conditionsEnvVarName().c_str());
+            if (childSettings->isShared())
+                runBroker(childSettings->remaining(), reporter);
+            else
+                runDirect(childSettings->remaining(), childSettings->clock(), 
+                          std::wstring_view(conditions ? conditions : L""), reporter);
+            return EXIT_SUCCESS;
+        } catch (std::exception & ex) {
+            reporter.failed(ex);
+        }
+        return EXIT_FAILURE;
+    }
+
     std::optional<ULONGLONG> duration;
+    std::optional<ULONGLONG> until;
+    std::optional<WaitClock> waitClock;
     std::optional<std::wstring> command;
-    std::vector<DWORD> pidsToKill;
+    StopOptions stopOptions;
+    std::vector<std::wstring> deadlineArgs;
+    QueryLimits queryLimits;
+    bool hasQueryOptions = false;
+    bool scanProcesses = false;
+    bool watch = false;
+    bool stats = false;
+    bool shared = false;
+    std::optional<std::wstring> metricsPath;
+    std::optional<ULONGLONG> metricsInterval;
+    std::vector<DWORD> whilePids;
+    std::vector<DWORD> whileTrees;
+    std::vector<std::wstring> whileLocked;
+    std::optional<std::wstring> tracePath;
+    std::optional<ListFormat> listFormat;
 
+    auto parseStart = Tracer::now();
     WParser parser;
     try {
         parser.add(WOption(L"--help", L"-h").handler(
             [&]() {
                 wprint(stdout, help(progname, Layout(stdout), shouldUseColor(envColorStatus, stdout)));
+                flushOutput();
                 std::exit(EXIT_SUCCESS);
         }));
         parser.add(WOption(L"--version").handler(
             [&]() {
                 wprint(stdout, L"" KEEP_AWAKE_VERSION "\n");
+                flushOutput();
                 std::exit(EXIT_SUCCESS);
         }));
+        auto parseLimit = [&](std::wstring_view value, ULONGLONG & dest) -> WExpected<void> {
+            auto maybeVal = parseDuration(value);
+            if (!maybeVal || *maybeVal == 0)
+                return {Failure<WParser::ValidationError>, std::format(L"invalid duration \"{}\"", value)};
+            dest = *maybeVal;
+            hasQueryOptions = true;
+            return {};
+        };
+        parser.add(WOption(L"--timeout").argument(L"duration").handler(
+            [&](const std::wstring_view & value) {
+                return parseLimit(value, queryLimits.perInstance);
+        }));
+        parser.add(WOption(L"--deadline").argument(L"duration").handler(
+            [&](const std::wstring_view & value) {
+                return parseLimit(value, queryLimits.total);
+        }));
+        parser.add(WOption(L"--until").argument(L"HH:MM").handler(
+            [&](const std::wstring_view & value) -> WExpected<void> {
+                auto maybeVal = parseTimeOfDay(value);
+                if (!maybeVal)
+                    return {Failure<WParser::ValidationError>, std::format(L"invalid time of day \"{}\"", value)};
+                until = *maybeVal;
+                return {};
+        }));
+        parser.add(WOption(L"--clock").argument(L"monotonic|boot|wall").handler(
+            [&](const std::wstring_view & value) -> WExpected<void> {
+                waitClock = parseWaitClock(value);
+                if (!waitClock)
+                    return {Failure<WParser::ValidationError>, std::format(L"invalid clock \"{}\"", value)};
+                return {};
+        }));
+        parser.add(WOption(L"--while-pid").argument(L"pid").occurs(zeroOrMoreTimes).handler(
+            [&](const std::wstring_view & value) {
+                whilePids.push_back(parseIntegral<DWORD>(value).value());
+        }));
+        parser.add(WOption(L"--while-tree").argument(L"pid").occurs(zeroOrMoreTimes).handler(
+            [&](const std::wstring_view & value) {
+                whileTrees.push_back(parseIntegral<DWORD>(value).value());
+        }));
+        parser.add(WOption(L"--while-locked").argument(L"file").occurs(zeroOrMoreTimes).handler(
+            [&](const std::wstring_view & value) {
+                whileLocked.emplace_back(value);
+        }));
+        parser.add(WOption(L"--scan").handler(
+            [&]() {
+                scanProcesses = true;
+        }));
+        parser.add(WOption(L"--shared").handler(
+            [&]() {
+                shared = true;
+        }));
+#if KEEP_AWAKE_TRACING
+        parser.add(WOption(L"--trace").argument(L"file").handler(
+            [&](const std::wstring_view & value) {
+                tracePath = value;
+        }));
+#endif
+        parser.add(WOption(L"--format").argument(L"table|json|csv|tsv").handler(
+            [&](const std::wstring_view & value) -> WExpected<void> {
+                listFormat = parseListFormat(value);
+                if (!listFormat)
+                    return {Failure<WParser::ValidationError>, std::format(L"invalid format \"{}\"", value)};
+                return {};
+        }));
+        parser.add(WOption(L"--watch").handler(
+            [&]() {
+                watch = true;
+        }));
+        parser.add(WOption(L"--stats").handler(
+            [&]() {
+                stats = true;
+        }));
+        parser.add(WOption(L"--interval").argument(L"duration").handler(
+            [&](const std::wstring_view & value) -> WExpected<void> {
+                auto maybeVal = parseDuration(value);
+                if (!maybeVal || *maybeVal == 0)
+                    return {Failure<WParser::ValidationError>, std::format(L"invalid duration \"{}\"", value)};
+                metricsInterval = *maybeVal;
+                return {};
+        }));
+        parser.add(WOption(L"--wait").handler(
+            [&]() {
+                stopOptions.wait = true;
+        }));
+        parser.add(WOption(L"--all").handler(
+            [&]() {
+                stopOptions.all = true;
+        }));
+        parser.add(WOption(L"--user").argument(L"name").handler(
+            [&](const std::wstring_view & value) {
+                stopOptions.user = value;
+        }));
+        parser.add(WOption(L"--session").argument(L"id").handler(
+            [&](const std::wstring_view & value) {
+                stopOptions.session = parseIntegral<DWORD>(value).value();
+        }));
+        parser.add(WOption(L"--older-than").argument(L"duration").handler(
+            [&](const std::wstring_view & value) -> WExpected<void> {
+                auto maybeVal = parseDuration(value);
+                if (!maybeVal)
+                    return {Failure<WParser::ValidationError>, std::format(L"invalid duration \"{}\"", value)};
+                stopOptions.olderThan = *maybeVal;
+                return {};
+        }));
         parser.add(WPositional(L"command").occurs(neverOrOnce).handler(
             [&](const std::wstring_view & value) -> WExpected<void> {
 
-                if (value == L"list" || value == L"stop") {
+                if (value == L"list" || value == L"stop" || value == L"extend" || value == L"set-remaining" || value == L"metrics") {
                     command = value;
                 } else if (auto maybeVal = parseDuration(value)) {
                     auto val = *maybeVal;
@@ -893,15 +4176,83 @@ int wmain(int argc, wchar_t * argv[]) {
             [&](const std::wstring_view & value) -> WExpected<void> {
 
                 if (command && *command == L"stop") {
-                    pidsToKill.push_back(parseIntegral<DWORD>(value).value());
+                    auto id = parseInstanceId(value);
+                    if (!id)
+                        return {Failure<WParser::ValidationError>, std::format(L"invalid instance \"{}\"", value)};
+                    stopOptions.ids.push_back(*id);
                     return {};
                 } 
+                if (command && (*command == L"extend" || *command == L"set-remaining")) {
+                    deadlineArgs.emplace_back(value);
+                    return {};
+                }
+                if (command && *command == L"metrics" && !metricsPath) {
+                    metricsPath = value;
+                    return {};
+                }
                     
                 return {Failure<WParser::ExtraPositional>, value};                
         }));
         parser.addValidator([&](const WValidationData & ) {
-            return !command || *command != L"stop" || !pidsToKill.empty();
-        }, L"stop command requires PID arguments");
+            return !command || *command != L"stop" || !stopOptions.ids.empty() || stopOptions.selectsInstances();
+        }, L"stop command requires PID arguments or one of --all, --user, --session, --older-than options");
+        parser.addValidator([&](const WValidationData & ) {
+            return stopOptions.ids.empty() || !stopOptions.selectsInstances();
+        }, L"PID arguments cannot be combined with --all, --user, --session or --older-than options");
+        parser.addValidator([&](const WValidationData & ) {
+            return !command || (*command != L"extend" && *command != L"set-remaining") || 
+                   (!deadlineArgs.empty() && parseDuration(deadlineArgs.back()));
+        }, L"extend and set-remaining commands require a duration argument");
+        parser.addValidator([&](const WValidationData & ) {
+            if (!command || (*command != L"extend" && *command != L"set-remaining") || deadlineArgs.empty())
+                return true;
+            auto ids = std::span(deadlineArgs).first(deadlineArgs.size() - 1);
+            if (stopOptions.selectsInstances())
+                return ids.empty();
+            return !ids.empty() && std::ranges::all_of(ids, [](const std::wstring & arg) { return parseInstanceId(arg).has_value(); });
+        }, L"extend and set-remaining commands require PID arguments or one of --all, --user, --session, --older-than options before the duration");
+        parser.addValidator([&](const WValidationData & ) {
+            return !stopOptions.selectsInstances() || (command && (*command == L"stop" || *command == L"extend" || *command == L"set-remaining"));
+        }, L"--all, --user, --session and --older-than options can only be used with stop, extend or set-remaining commands");
+        parser.addValidator([&](const WValidationData & ) {
+            return !stopOptions.wait || (command && *command == L"stop");
+        }, L"--wait option can only be used with stop command");
+        parser.addValidator([&](const WValidationData & ) {
+            return !watch || (command && *command == L"list" && !scanProcesses);
+        }, L"--watch option can only be used with list command and cannot be combined with --scan");
+        parser.addValidator([&](const WValidationData & ) {
+            return !listFormat || (command && *command == L"list" && !watch);
+        }, L"--format option can only be used with list command and cannot be combined with --watch");
+        parser.addValidator([&](const WValidationData & ) {
+            return !stats || (command && *command == L"list" && !watch && listFormat.value_or(ListFormat::table) == ListFormat::table);
+        }, L"--stats option can only be used with list command and cannot be combined with --watch or --format other than table");
+        parser.addValidator([&](const WValidationData & ) {
+            return !command || *command != L"metrics" || metricsPath;
+        }, L"metrics command requires output file argument");
+        parser.addValidator([&](const WValidationData & ) {
+            return !metricsInterval || (command && *command == L"metrics");
+        }, L"--interval option can only be used with metrics command");
+        parser.addValidator([&](const WValidationData & ) {
+            return !shared || !command;
+        }, L"--shared option cannot be combined with commands");
+        parser.addValidator([&](const WValidationData & ) {
+            return (whilePids.empty() && whileTrees.empty() && whileLocked.empty()) || (!shared && !command);
+        }, L"--while-pid, --while-tree and --while-locked options cannot be combined with --shared or commands");
+        parser.addValidator([&](const WValidationData & ) {
+            return whilePids.size() + whileTrees.size() + whileLocked.size() <= g_maxWaitConditions;
+        }, std::format(L"at most {} --while-pid, --while-tree and --while-locked conditions can be given", g_maxWaitConditions));
+        parser.addValidator([&](const WValidationData & ) {
+            return !until || (!duration && !command);
+        }, L"--until option cannot be combined with duration or commands");
+        parser.addValidator([&](const WValidationData & ) {
+            return !waitClock || (!until && !shared && !command);
+        }, L"--clock option cannot be combined with --until, --shared or commands");
+        parser.addValidator([&](const WValidationData & ) {
+            return !hasQueryOptions || command;
+        }, L"--timeout and --deadline options can only be used with commands");
+        parser.addValidator([&](const WValidationData & ) {
+            return !scanProcesses || command;
+        }, L"--scan option can only be used with commands");
         
         if (auto err = parser.parse(argc, argv).error()) {
             auto useColor = shouldUseColor(envColorStatus, stderr);
@@ -910,48 +4261,63 @@ int wmain(int argc, wchar_t * argv[]) {
                    usage(progname, Layout(stderr), useColor));
             return EXIT_FAILURE;
         }
-        
+        if (tracePath) {
+            Tracer::start(*tracePath, true);
+            Tracer::record("parse arguments", parseStart, Tracer::now());
+        }
 
         if (command) {
             if (*command == L"list") {
-                listProcesses(envColorStatus);
+                if (watch)
+                    watchProcesses(envColorStatus, queryLimits);
+                if (listFormat.value_or(ListFormat::table) != ListFormat::table)
+                    streamProcesses(queryLimits, scanProcesses, *listFormat);
+                else
+                    listProcesses(envColorStatus, queryLimits, scanProcesses, stats);
                 return EXIT_SUCCESS;
             } 
+            if (*command == L"extend" || *command == L"set-remaining") {
+                auto change = *command == L"extend" ? DeadlineChange::extend : DeadlineChange::setRemaining;
+                for (auto & arg: std::span(deadlineArgs).first(deadlineArgs.size() - 1))
+                    stopOptions.ids.push_back(*parseInstanceId(arg));
+                auto durationMs = *parseDuration(deadlineArgs.back());
+                return changeDeadlines(envColorStatus, change, durationMs, stopOptions, queryLimits, scanProcesses) ? EXIT_SUCCESS : EXIT_FAILURE;
+            }
+            if (*command == L"metrics") {
+                MetricsExporter(*metricsPath, queryLimits, scanProcesses).run(metricsInterval);
+                return EXIT_SUCCESS;
+            }
 
             assert(*command == L"stop");
-            assert(!pidsToKill.empty());
-            for(auto pid: pidsToKill) {
-                auto useColor = shouldUseColor(envColorStatus, stdout);
-                if (kill(pid))
-                    wprint(stdout, L"{0}stop request successfully sent to process{1} {2}{3}{1}\n",
-                        makeWColor<KA_COLOR_SUCCESS>(useColor),
-                        makeWColor<Color::normal>(useColor),
-                        makeWColor<KA_COLOR_PID>(useColor),
-                        pid);
-                else
-                    wprint(stdout, L"{0}unable to send stop request to process{1} {2}{3}{1}\n",
-                        makeWColor<KA_COLOR_ERROR>(useColor),
-                        makeWColor<Color::normal>(useColor),
-                        makeWColor<KA_COLOR_PID>(useColor),
-                        pid);
-            }
-            return EXIT_SUCCESS;
+            return stopProcesses(envColorStatus, stopOptions, queryLimits, scanProcesses) ? EXIT_SUCCESS : EXIT_FAILURE;
         }
         
-        if (isChild)
-            runDirect(duration, envColorStatus);
-        else
-            runChild(envColorStatus);
+        if (until)
+            duration = durationUntil(*until);
+
+        if (shared) {
+            //Attach to a running broker if there is one, otherwise start it
+            AcquireLeaseReply granted;
+            if (acquireLease(duration, Deadline::after(g_brokerAttachTimeout), granted) == ERROR_SUCCESS) {
+                printLeaseGranted(shouldUseColor(envColorStatus, stdout), duration, granted.pid, granted.leaseId);
+                g_stdout.flush();
+                return EXIT_SUCCESS;
+            }
+        }
+        std::vector<WaitCondition> conditions;
+        for (auto pid: whilePids)
+            conditions.push_back(openProcessCondition(pid));
+        for (auto pid: whileTrees)
+            conditions.push_back(openTreeCondition(pid));
+        for (auto & path: whileLocked)
+            conditions.push_back(openLockCondition(path));
+        runChild(ChildSettings::make(duration, until ? WaitClock::wall : waitClock.value_or(WaitClock::boot), shared), conditions, envColorStatus);
 
         return EXIT_SUCCESS;
 
     } catch (std::exception & ex) {
         auto colorizer = wideColorizerForFile(envColorStatus, stderr);
-        auto message = widen(ex.what());
-        if (isChild)
-            wprint(stderr, colorizer.error(std::format(L"{}: (child): {}", progname, message)));
-        else
-            wprint(stderr, colorizer.error(std::format(L"{}: {}", progname, message)));
+        wprint(stderr, colorizer.error(std::format(L"{}: {}", progname, widen(ex.what()))));
     }
     return EXIT_FAILURE;
 }
@@ -12,11 +12,28 @@
 #include <shellapi.h>
 #include <wtsapi32.h>
 #include <sddl.h>
+#include <aclapi.h>
+#include <psapi.h>
+#include <tlhelp32.h>
 
 #define ARGUM_USE_EXPECTED
 #include <argum.h>
 
-#include <ctre.hpp>
-
 #include <format>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <coroutine>
+#include <expected>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <mutex>
+#include <random>
+#include <ranges>
+#include <set>
+#include <span>
+#include <thread>
 #include <io.h>
+#include <malloc.h>
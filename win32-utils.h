@@ -0,0 +1,194 @@
+#pragma once
+
+// Win32 helpers shared by keep-awake and its client library
+
+#pragma region General Win32 Utilities
+
+inline std::wstring widen(std::string_view str) {
+    int size_needed = MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), nullptr, 0);
+    std::wstring ret(size_needed, 0);
+    MultiByteToWideChar(CP_UTF8, 0, str.data(), int(str.size()), ret.data(), size_needed);
+    return ret;
+}
+
+inline std::string narrow(std::wstring_view str) {
+    int size_needed = WideCharToMultiByte(CP_UTF8, 0, str.data(), int(str.size()), nullptr, 0, nullptr, nullptr);
+    std::string ret(size_needed, 0);
+    WideCharToMultiByte(CP_UTF8, 0, str.data(), int(str.size()), ret.data(), size_needed, nullptr, nullptr);
+    return ret;
+}
+
+template<uintptr_t InvalidValue>
+class BasicAutoHandle {
+public:
+    BasicAutoHandle() noexcept = default;
+    BasicAutoHandle(HANDLE h) noexcept :
+        m_handle(h)
+    {}
+    ~BasicAutoHandle() noexcept {
+        if (m_handle != HANDLE(InvalidValue))
+            CloseHandle(m_handle);
+    }
+    BasicAutoHandle(BasicAutoHandle && src) noexcept : 
+        m_handle(std::exchange(src.m_handle, HANDLE(InvalidValue)))
+    {}
+    BasicAutoHandle & operator=(BasicAutoHandle && src) noexcept {
+        if (m_handle != HANDLE(InvalidValue))
+            CloseHandle(m_handle);
+        m_handle = std::exchange(src.m_handle, HANDLE(InvalidValue));
+        return *this;
+    }
+    BasicAutoHandle(const BasicAutoHandle &) = delete;
+    BasicAutoHandle & operator=(const BasicAutoHandle &) = delete;
+
+    HANDLE get() const 
+        { return m_handle; }
+    HANDLE & out() 
+        { return m_handle; }
+    void reset() {
+        if (m_handle != HANDLE(InvalidValue)) {
+            CloseHandle(m_handle);
+            m_handle = HANDLE(InvalidValue);
+        }
+    }
+    explicit operator bool() const 
+        { return m_handle != HANDLE(InvalidValue); }
+private:
+    HANDLE m_handle = HANDLE(InvalidValue);
+};
+
+using AutoHandle = BasicAutoHandle<0>;
+using AutoFile = BasicAutoHandle<uintptr_t(-1)>;
+
+struct LocalAllocDeleter {
+	void operator()(void * ptr) { LocalFree(ptr); }
+};
+
+template<class T>
+requires(
+	(!std::is_array_v<T> && std::is_trivially_destructible_v<T>) ||
+	(std::is_array_v<T> && std::is_trivially_destructible_v<std::remove_all_extents_t<T>>)
+)
+using unqiue_local_membuf = std::unique_ptr<T, LocalAllocDeleter>;
+
+struct WTSDeleter {
+    void operator()(void * ptr) { if (ptr) WTSFreeMemory(ptr); }
+};
+
+struct MappedViewDeleter {
+    void operator()(void * ptr) { if (ptr) UnmapViewOfFile(ptr); }
+};
+
+//static std::wstring win32ErrorMessage(DWORD err) {
+//    return widen(std::error_code(int(err), std::system_category()).message());
+//}
+
+[[noreturn]]
+inline void throwWin32Error(DWORD err, const char * doingWhat) {
+    throw std::system_error(std::error_code(int(err), std::system_category()), doingWhat);
+}
+
+[[noreturn]]
+inline void throwLastError(const char * doingWhat) {
+    throwWin32Error(GetLastError(), doingWhat);
+}
+
+inline std::wstring myname() {
+    std::wstring ret;
+
+    DWORD size = 32;
+    for( ; ; ) {
+        ret.resize(size);
+        auto res = GetModuleFileNameW(nullptr, ret.data(), size);
+        if (res < size) {
+            ret.resize(res);
+            break;
+        }
+        auto err = GetLastError();
+        if (err == ERROR_SUCCESS)
+            break;
+        if (err == ERROR_INSUFFICIENT_BUFFER) {
+            if (res < std::numeric_limits<DWORD>::max() / 2)
+                size *= 2;
+            else if (res < std::numeric_limits<DWORD>::max() - 32)
+                size += 32;
+            else
+                throw std::bad_alloc();
+            continue;
+        }
+        throwWin32Error(err, "GetModuleFileName(nullptr)");
+    }
+    return ret;
+}
+
+inline ULONGLONG fileTimeToUInt64(const FILETIME & ft) {
+    return (ULONGLONG(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+}
+
+// Milliseconds since the Unix epoch of a FILETIME value
+inline ULONGLONG fileTimeToUnixMs(ULONGLONG ft) {
+    //FILETIME of 1970-01-01
+    constexpr ULONGLONG unixEpoch = 116'444'736'000'000'000;
+    return (ft - std::min(ft, unixEpoch)) / 10'000;
+}
+
+inline unqiue_local_membuf<SECURITY_DESCRIPTOR> makeSecurityDescriptor(const wchar_t * sddl) {
+    unqiue_local_membuf<SECURITY_DESCRIPTOR> desc;
+    ULONG descSize;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptor(sddl, SDDL_REVISION_1, std::out_ptr(desc), &descSize))
+        throwLastError("ConvertStringSecurityDescriptorToSecurityDescriptor");
+    return desc;
+}
+
+inline void getTokenInfo(HANDLE token, TOKEN_INFORMATION_CLASS infoClass, std::vector<BYTE> & buf) {
+
+    while (true) {
+        DWORD size;
+        if (GetTokenInformation(token, infoClass, buf.data(), DWORD(buf.size()), &size)) {
+            buf.resize(size);
+            break;
+        }
+        auto err = GetLastError();
+        if (err != ERROR_INSUFFICIENT_BUFFER)
+            throwWin32Error(err, "GetTokenInformation");
+        buf.resize(size);
+    }
+}
+
+// A point in GetTickCount64() time by which an operation has to complete
+class Deadline {
+public:
+    static Deadline after(ULONGLONG ms) noexcept {
+        auto now = GetTickCount64();
+        if (ms >= std::numeric_limits<ULONGLONG>::max() - now)
+            return never();
+        return Deadline(now + ms);
+    }
+    static Deadline never() noexcept
+        { return Deadline(std::numeric_limits<ULONGLONG>::max()); }
+    static Deadline at(ULONGLONG tick) noexcept
+        { return Deadline(tick); }
+
+    bool expired() const noexcept
+        { return GetTickCount64() >= m_tick; }
+
+    //Milliseconds left, suitable for passing to Win32 wait functions
+    DWORD remaining() const noexcept {
+        if (m_tick == std::numeric_limits<ULONGLONG>::max())
+            return INFINITE;
+        auto now = GetTickCount64();
+        if (now >= m_tick)
+            return 0;
+        return DWORD(std::min(m_tick - now, ULONGLONG(INFINITE - 1)));
+    }
+
+    friend auto operator<=>(const Deadline &, const Deadline &) noexcept = default;
+private:
+    explicit Deadline(ULONGLONG tick) noexcept:
+        m_tick(tick)
+    {}
+private:
+    ULONGLONG m_tick;
+};
+
+#pragma endregion